@@ -1,9 +1,79 @@
 // To be included in xstat.c
 
+#include <linux/percpu.h>
+#include <linux/tick.h>
 #include <linux/time.h>
 
+// Interrupts the samplers cause per CPU: their own wakeups, and an IPI for
+// each read of a per-CPU counter from another CPU. See the noise attr.
+struct xstat_noise {
+    unsigned long wakeups;
+    unsigned long ipis;
+};
+static DEFINE_PER_CPU(struct xstat_noise, xstat_noise);
+
+static void xstat_noise_read(int cpu) {
+    if (cpu != raw_smp_processor_id())
+        per_cpu(xstat_noise, cpu).ipis++;
+}
+
+// Idle-aware sampling. A CPU that stayed in idle (or iowait) for the whole
+// last tick cannot have moved its per-CPU counters, so perf_restart leaves
+// it alone rather than pulling it out of its C-state with an IPI.
+struct xstat_idle {
+    uint64_t idle_us;
+    uint64_t wall_us;
+    bool skip;
+};
+static DEFINE_PER_CPU(struct xstat_idle, xstat_idle);
+static bool xstat_idle_aware;
+
+static void xstat_idle_update(const struct cpumask *mask) {
+    struct xstat_idle *st;
+    uint64_t idle, iowait, wall;
+    int cpu;
+    for_each_cpu(cpu, mask) {
+        st = &per_cpu(xstat_idle, cpu);
+        idle = get_cpu_idle_time_us(cpu, &wall);
+        iowait = get_cpu_iowait_time_us(cpu, NULL);
+        if (idle == -1ULL || iowait == -1ULL) {
+            // No NO_HZ accounting to tell.
+            st->skip = false;
+            continue;
+        }
+        idle += iowait;
+        st->skip = st->wall_us && cpu != raw_smp_processor_id() &&
+            idle - st->idle_us >= wall - st->wall_us;
+        st->idle_us = idle;
+        st->wall_us = wall;
+    }
+}
+
+static bool xstat_idle_skip(int cpu) {
+    return xstat_idle_aware && per_cpu(xstat_idle, cpu).skip;
+}
+
+static int idlecpu_init(const struct cpumask *mask, void *data, void **ctx) {
+    *ctx = (void *) mask;
+    return 0;
+}
+
+// CPUs of the node whose counters were carried forward in this record.
+static uint64_t idlecpu_restart(void **ctx, uint64_t last) {
+    const struct cpumask *mask = (const struct cpumask *) *ctx;
+    uint64_t n = 0;
+    int cpu;
+    if (!mask)
+        return 0;
+    for_each_cpu(cpu, mask) {
+        if (xstat_idle_skip(cpu))
+            n++;
+    }
+    return n;
+}
+
 static uint64_t get_time(void) {
-    static struct timespec ts;
+    struct timespec ts;
     do_posix_clock_monotonic_gettime(&ts);
     return timespec_to_ns(&ts);
 }
@@ -25,5 +95,6 @@ static uint64_t intv_restart(void **ctx, uint64_t last) {
 }
 
 // These counters must be put together
-static struct xstat_counter ts_counter = __XSTAT_CNT(ts, NULL, NULL, ts_restart, NULL, NULL);
-static struct xstat_counter intv_counter = __XSTAT_CNT(intv, NULL, NULL, intv_restart, NULL, NULL);
+static struct xstat_counter ts_counter = __XSTAT_CNT(ts, NULL, NULL, ts_restart, NULL);
+static struct xstat_counter intv_counter = __XSTAT_DCNT(intv, NULL, NULL, intv_restart, NULL);
+static struct xstat_counter idlecpu_counter = __XSTAT_CNT(idlecpu, idlecpu_init, NULL, idlecpu_restart, NULL);
@@ -0,0 +1,313 @@
+// To be included in xstat.c after struct xstat_node
+
+// Package power capping. With cap_budget set to a number of watts the sampler
+// of the first node splits it evenly over the packages as RAPL PL1 limits,
+// then each tick moves cap_step watts of limit from the package leaving the
+// most of its limit unused to the one on the critical path: a package that
+// was throttled (the perflmt PROCHOT, thermal, PL1 and PL2 logs), or else
+// the one with the most unhalted cycles per CPU. Limits stay between the
+// package's RAPL minimum and its TDP. The limits found at the start are
+// written back when the budget is cleared or sampling stops.
+
+#ifndef MSR_PKG_POWER_LIMIT
+#define MSR_PKG_POWER_LIMIT 0x00000610
+#endif
+#ifndef MSR_PKG_POWER_INFO
+#define MSR_PKG_POWER_INFO 0x00000614
+#endif
+
+#define XSTAT_CAP_NPKG      8
+#define XSTAT_CAP_PL1_MASK  0x7fffULL
+#define XSTAT_CAP_PL1_EN    (1ULL << 15)
+#define XSTAT_CAP_LOCK      (1ULL << 63)
+// PROCHOT, thermal, PL1 and PL2 logs of MSR_CORE_PERF_LIMIT_REASONS. The turbo
+// limit logs are set in normal turbo operation and left out.
+#define XSTAT_CAP_THROTTLE_LOG  0x0c030000ULL
+
+// What a node sampler saw in its last tick.
+struct xstat_cap_report {
+    int pkg;
+    int ncpus;
+    unsigned int power_mw;
+    uint64_t cyc;
+    bool throttled;
+};
+
+struct xstat_cap_pkg {
+    bool valid;
+    int cpu;
+    uint64_t orig;
+    int unit;
+    unsigned int min_mw;
+    unsigned int max_mw;
+    unsigned int limit_mw;
+    // Summed over the reports of its nodes.
+    unsigned int power_mw;
+    uint64_t cyc;
+    int ncpus;
+    bool throttled;
+};
+
+static DEFINE_SPINLOCK(xstat_cap_lock);
+static struct xstat_cap_report xstat_cap_reports[MAX_NUMNODES];
+static struct xstat_cap_pkg xstat_cap_pkgs[XSTAT_CAP_NPKG];
+static unsigned int xstat_cap_budget;
+static unsigned int xstat_cap_step;
+// Budget the limits were split from, 0 if they are the original ones.
+static unsigned int xstat_cap_active;
+static bool xstat_cap_failed;
+
+static bool xstat_cap_driver(struct xstat_node *node) {
+    int i;
+    for (i = 0; i < node->id; i++) {
+        if (xstat_nodes[i])
+            return false;
+    }
+    return true;
+}
+
+static unsigned int xstat_cap_mw(struct xstat_cap_pkg *pkg, uint64_t raw) {
+    return (raw * 1000) >> pkg->unit;
+}
+
+static void xstat_cap_write(struct xstat_cap_pkg *pkg, uint64_t val) {
+    wrmsr_on_cpu(pkg->cpu, MSR_PKG_POWER_LIMIT, (uint32_t) val, val >> 32);
+}
+
+static void xstat_cap_apply(struct xstat_cap_pkg *pkg) {
+    uint64_t raw = div_u64((uint64_t) pkg->limit_mw << pkg->unit, 1000);
+    xstat_cap_write(pkg, (pkg->orig & ~XSTAT_CAP_PL1_MASK) |
+            (raw & XSTAT_CAP_PL1_MASK) | XSTAT_CAP_PL1_EN);
+}
+
+static void xstat_cap_restore(void) {
+    int i;
+    if (!xstat_cap_active)
+        return;
+    for (i = 0; i < XSTAT_CAP_NPKG; i++) {
+        if (xstat_cap_pkgs[i].valid)
+            xstat_cap_write(&xstat_cap_pkgs[i], xstat_cap_pkgs[i].orig);
+    }
+    xstat_cap_active = 0;
+}
+
+// Finds the packages, keeps their limits and splits budget over them.
+static int xstat_cap_setup(unsigned int budget) {
+    struct xstat_cap_pkg *pkg;
+    uint32_t lo, hi;
+    uint64_t info;
+    int i, id, npkg = 0;
+
+    memset(xstat_cap_pkgs, 0, sizeof(xstat_cap_pkgs));
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        if (!xstat_nodes[i])
+            continue;
+        id = topology_physical_package_id(xstat_nodes[i]->cpu);
+        if (id < 0 || id >= XSTAT_CAP_NPKG || xstat_cap_pkgs[id].valid)
+            continue;
+        pkg = &xstat_cap_pkgs[id];
+        pkg->cpu = xstat_nodes[i]->cpu;
+        if (rdmsr_safe_on_cpu(pkg->cpu, MSR_RAPL_POWER_UNIT, &lo, &hi))
+            return -EIO;
+        pkg->unit = lo & 0xf;
+        if (rdmsr_safe_on_cpu(pkg->cpu, MSR_PKG_POWER_INFO, &lo, &hi))
+            return -EIO;
+        info = ((uint64_t) hi << 32) | lo;
+        pkg->max_mw = xstat_cap_mw(pkg, info & XSTAT_CAP_PL1_MASK);
+        pkg->min_mw = xstat_cap_mw(pkg, (info >> 16) & XSTAT_CAP_PL1_MASK);
+        if (pkg->min_mw == 0 || pkg->min_mw > pkg->max_mw)
+            pkg->min_mw = pkg->max_mw / 4;
+        if (rdmsr_safe_on_cpu(pkg->cpu, MSR_PKG_POWER_LIMIT, &lo, &hi))
+            return -EIO;
+        pkg->orig = ((uint64_t) hi << 32) | lo;
+        if (pkg->orig & XSTAT_CAP_LOCK)
+            return -EPERM;
+        pkg->valid = true;
+        npkg++;
+    }
+    if (npkg == 0)
+        return -ENODEV;
+
+    for (i = 0; i < XSTAT_CAP_NPKG; i++) {
+        pkg = &xstat_cap_pkgs[i];
+        if (!pkg->valid)
+            continue;
+        pkg->limit_mw = clamp_t(unsigned int, budget * 1000 / npkg, pkg->min_mw, pkg->max_mw);
+        xstat_cap_apply(pkg);
+    }
+    xstat_cap_active = budget;
+    return 0;
+}
+
+// Higher for the package more in need of power.
+static uint64_t xstat_cap_score(struct xstat_cap_pkg *pkg) {
+    uint64_t util = pkg->ncpus ? div_u64(pkg->cyc, pkg->ncpus) : 0;
+    return pkg->throttled ? (1ULL << 62) + util : util;
+}
+
+// One control step, by the sampler of the first node.
+static void xstat_cap_step(void) {
+    struct xstat_cap_pkg *pkg, *recv = NULL, *donor = NULL;
+    unsigned int budget = ACCESS_ONCE(xstat_cap_budget);
+    unsigned int step = ACCESS_ONCE(xstat_cap_step) * 1000;
+    struct xstat_cap_report *rep;
+    int i, ret;
+
+    if (budget != xstat_cap_active)
+        xstat_cap_restore();
+    if (!budget || xstat_cap_failed)
+        return;
+    if (!xstat_cap_active) {
+        ret = xstat_cap_setup(budget);
+        if (ret < 0) {
+            printk(KERN_WARNING "xstat: cannot set package power limits: %d.\n", ret);
+            xstat_cap_failed = true;
+        }
+        return;
+    }
+
+    spin_lock(&xstat_cap_lock);
+    for (i = 0; i < XSTAT_CAP_NPKG; i++) {
+        xstat_cap_pkgs[i].power_mw = 0;
+        xstat_cap_pkgs[i].cyc = 0;
+        xstat_cap_pkgs[i].ncpus = 0;
+        xstat_cap_pkgs[i].throttled = false;
+    }
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        rep = &xstat_cap_reports[i];
+        if (!xstat_nodes[i] || !rep->ncpus || rep->pkg < 0 || rep->pkg >= XSTAT_CAP_NPKG)
+            continue;
+        pkg = &xstat_cap_pkgs[rep->pkg];
+        // Package counters, the same in every report of the package.
+        pkg->power_mw = rep->power_mw;
+        pkg->throttled |= rep->throttled;
+        pkg->cyc += rep->cyc;
+        pkg->ncpus += rep->ncpus;
+    }
+    spin_unlock(&xstat_cap_lock);
+
+    for (i = 0; i < XSTAT_CAP_NPKG; i++) {
+        pkg = &xstat_cap_pkgs[i];
+        if (!pkg->valid)
+            continue;
+        if (!recv || xstat_cap_score(pkg) > xstat_cap_score(recv))
+            recv = pkg;
+    }
+    for (i = 0; i < XSTAT_CAP_NPKG; i++) {
+        pkg = &xstat_cap_pkgs[i];
+        if (!pkg->valid || pkg == recv || pkg->limit_mw < pkg->min_mw + step)
+            continue;
+        if (!donor || (int) (pkg->limit_mw - pkg->power_mw) >
+                (int) (donor->limit_mw - donor->power_mw))
+            donor = pkg;
+    }
+    if (!recv || !donor || recv->limit_mw + step > recv->max_mw ||
+            donor->limit_mw < donor->power_mw + step)
+        return;
+    if (!recv->throttled && xstat_cap_score(recv) <= xstat_cap_score(donor))
+        return;
+    donor->limit_mw -= step;
+    recv->limit_mw += step;
+    xstat_cap_apply(donor);
+    xstat_cap_apply(recv);
+}
+
+// Called by the node sampler with the values of each tick.
+static void xstat_cap_update(struct xstat_node *node, const uint64_t *vals) {
+    struct xstat_layout *layout = node->layout;
+    struct xstat_cap_report *rep = &xstat_cap_reports[node->id];
+    uint64_t energy, intv, mj;
+    int eunit;
+
+    energy = vals[layout->first[counter_index(&energy_counter)]];
+    eunit = vals[layout->first[counter_index(&eunit_counter)]];
+    intv = vals[layout->first[counter_index(&intv_counter)]];
+    mj = (energy * 1000) >> eunit;
+
+    spin_lock(&xstat_cap_lock);
+    rep->pkg = topology_physical_package_id(node->cpu);
+    rep->ncpus = cpumask_weight(node->mask);
+    rep->power_mw = intv ? div64_u64(mj * 1000000000, intv) : 0;
+    rep->cyc = vals[layout->first[counter_index(&cyc_counter)]];
+    rep->throttled = vals[layout->first[counter_index(&perflmt_counter)]] & XSTAT_CAP_THROTTLE_LOG;
+    spin_unlock(&xstat_cap_lock);
+
+    if (xstat_cap_driver(node))
+        xstat_cap_step();
+}
+
+static void xstat_cap_stop(struct xstat_node *node) {
+    if (xstat_cap_driver(node))
+        xstat_cap_restore();
+}
+
+// Limit, last power in mW and whether it was throttled, per package.
+static ssize_t show_cap_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        char *buf) {
+    struct xstat_cap_pkg *pkg;
+    int limit = PAGE_SIZE;
+    char *ptr = buf;
+    int ret, i;
+
+    for (i = 0; i < XSTAT_CAP_NPKG && xstat_cap_active; i++) {
+        pkg = &xstat_cap_pkgs[i];
+        if (!pkg->valid)
+            continue;
+        ret = scnprintf(ptr, limit, "package%d %u %u %d\n", i, pkg->limit_mw,
+                pkg->power_mw, pkg->throttled);
+        ptr += ret;
+        limit -= ret;
+    }
+    return ptr - buf;
+}
+
+// In watts, 0 to leave the limits alone.
+static ssize_t store_cap_budget_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        const char *buf,
+        size_t count) {
+    unsigned long tmp;
+    int ret;
+    ret = kstrtoul(buf, 0, &tmp);
+    if (ret == 0 && tmp <= 100000) {
+        xstat_cap_failed = false;
+        xstat_cap_budget = tmp;
+    }
+    return count;
+}
+
+static ssize_t show_cap_budget_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        char *buf) {
+    return sprintf(buf, "%u\n", xstat_cap_budget);
+}
+
+static ssize_t show_cap_step_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        char *buf) {
+    return sprintf(buf, "%u\n", xstat_cap_step);
+}
+
+static ssize_t store_cap_step_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        const char *buf,
+        size_t count) {
+    unsigned long tmp;
+    int ret;
+    ret = kstrtoul(buf, 0, &tmp);
+    if (ret == 0 && tmp > 0 && tmp <= 1000) {
+        xstat_cap_step = tmp;
+    }
+    return count;
+}
+
+#define XSTAT_CAP_CLASS_ATTRS \
+    __ATTR(cap, 0444, show_cap_attr, NULL), \
+    __ATTR(cap_budget, 0644, show_cap_budget_attr, store_cap_budget_attr), \
+    __ATTR(cap_step, 0644, show_cap_step_attr, store_cap_step_attr),
@@ -0,0 +1,161 @@
+// To be included in xstat.c after struct xstat_node
+
+#include <linux/cpufreq.h>
+
+// Clock and thermal events. cpufreq transitions are logged as the kernel
+// reports them. Thermal and throttle transitions come from the package
+// thermal status the sampler reads each tick: a change of a status bit, or a
+// log bit set for a status that came and went within the tick. The logs are
+// then cleared, as perflmt does. Each event goes to the event ring of the
+// CPU's node, read incrementally with XSTAT_IOC_EVENTS on /dev/xstat<node>;
+// the events<node> attr shows the newest.
+
+// Bits kept from IA32_PACKAGE_THERM_STATUS: thermal status, PROCHOT,
+// critical temperature, the two thresholds and power limit, each with its
+// log in the next bit up.
+#define XSTAT_THERM_MASK    0x0fffULL
+#define XSTAT_THERM_STATUS  0x0555ULL
+// Events the attr shows.
+#define XSTAT_EVENT_SHOW    64
+
+// Status bits of each node's package at its last tick.
+static uint32_t xstat_therm_state[MAX_NUMNODES];
+
+static void xstat_event_log(int cpu, int type, uint32_t from, uint32_t to) {
+    struct xstat_node *node = xstat_nodes[cpu_to_node(cpu)];
+    struct xstat_event_ring *events;
+    struct xstat_event *ev;
+    unsigned long flags;
+
+    if (!node)
+        return;
+    events = &node->events;
+    spin_lock_irqsave(&events->lock, flags);
+    ev = &events->ring[events->seq % XSTAT_NEVENT];
+    ev->ts = get_time();
+    ev->cpu = cpu;
+    ev->type = type;
+    ev->from = from;
+    ev->to = to;
+    events->seq++;
+    spin_unlock_irqrestore(&events->lock, flags);
+}
+
+static int xstat_freq_notify(struct notifier_block *nb, unsigned long val, void *data) {
+    struct cpufreq_freqs *freqs = data;
+    if (val == CPUFREQ_POSTCHANGE)
+        xstat_event_log(freqs->cpu, XSTAT_EVENT_FREQ, freqs->old, freqs->new);
+    return NOTIFY_OK;
+}
+
+static struct notifier_block xstat_freq_nb = {
+    .notifier_call = xstat_freq_notify,
+};
+
+// Called by the node sampler each tick, on its CPU. A node sharing its
+// package with another sees the logs only if it reads them first.
+static void xstat_therm_update(struct xstat_node *node) {
+    uint32_t old = xstat_therm_state[node->id];
+    uint32_t state, logs;
+    uint64_t status;
+
+    if (!boot_cpu_has(X86_FEATURE_PTS) ||
+            rdmsrl_safe(MSR_IA32_PACKAGE_THERM_STATUS, &status))
+        return;
+    state = status & XSTAT_THERM_STATUS;
+    logs = (status >> 1) & XSTAT_THERM_STATUS;
+    if (logs)
+        wrmsrl_safe(MSR_IA32_PACKAGE_THERM_STATUS, status & ~(XSTAT_THERM_STATUS << 1));
+    xstat_therm_state[node->id] = state;
+    if (state != old || (logs & ~state & ~old))
+        xstat_event_log(node->cpu, XSTAT_EVENT_THERM, old, status & XSTAT_THERM_MASK);
+}
+
+static void xstat_events_init(void) {
+    if (cpufreq_register_notifier(&xstat_freq_nb, CPUFREQ_TRANSITION_NOTIFIER) < 0)
+        printk(KERN_WARNING "xstat: cpufreq transitions not logged.\n");
+}
+
+static void xstat_events_exit(void) {
+    cpufreq_unregister_notifier(&xstat_freq_nb, CPUFREQ_TRANSITION_NOTIFIER);
+}
+
+static const char *xstat_event_names[] = {
+    [XSTAT_EVENT_FREQ] = "freq",
+    [XSTAT_EVENT_THERM] = "therm",
+};
+
+// Events logged so far, then the newest of the ring, oldest first: ts, cpu,
+// type, from and to.
+static ssize_t show_events_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        char *buf) {
+    struct xstat_node *node = container_of(attr, struct xstat_node, events_attr);
+    struct xstat_event_ring *events = &node->events;
+    struct xstat_event *ring, *ev;
+    int limit = PAGE_SIZE;
+    char *ptr = buf;
+    uint64_t seq;
+    int ret, n, i;
+
+    ring = kmalloc(XSTAT_EVENT_SHOW * sizeof(struct xstat_event), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+    spin_lock_irq(&events->lock);
+    seq = events->seq;
+    n = min_t(uint64_t, seq, XSTAT_EVENT_SHOW);
+    for (i = 0; i < n; i++)
+        ring[i] = events->ring[(seq - n + i) % XSTAT_NEVENT];
+    spin_unlock_irq(&events->lock);
+
+    ret = scnprintf(ptr, limit, "events %llu\n", seq);
+    ptr += ret;
+    limit -= ret;
+    for (i = 0; i < n; i++) {
+        ev = &ring[i];
+        ret = scnprintf(ptr, limit, "%llu %u %s %u %u\n", ev->ts, ev->cpu,
+                xstat_event_names[ev->type], ev->from, ev->to);
+        ptr += ret;
+        limit -= ret;
+    }
+    kfree(ring);
+    return ptr - buf;
+}
+
+// Events from q.seq on, as many as fit in q.len.
+static long xstat_ioctl_events(struct xstat_node *node, struct xstat_events __user *uarg) {
+    struct xstat_event_ring *events = &node->events;
+    struct xstat_events q;
+    struct xstat_event *ring;
+    uint64_t oldest;
+    int n, i;
+    long ret = 0;
+
+    if (copy_from_user(&q, uarg, sizeof(q)))
+        return -EFAULT;
+    n = min_t(uint64_t, div64_u64(q.len, sizeof(struct xstat_event)), XSTAT_NEVENT);
+    ring = kmalloc(max(n, 1) * sizeof(struct xstat_event), GFP_KERNEL);
+    if (!ring)
+        return -ENOMEM;
+
+    spin_lock_irq(&events->lock);
+    oldest = events->seq - min_t(uint64_t, events->seq, XSTAT_NEVENT);
+    q.lost = 0;
+    if (q.seq < oldest) {
+        q.lost = oldest - q.seq;
+        q.seq = oldest;
+    }
+    n = min_t(uint64_t, n, events->seq > q.seq ? events->seq - q.seq : 0);
+    for (i = 0; i < n; i++)
+        ring[i] = events->ring[(q.seq + i) % XSTAT_NEVENT];
+    spin_unlock_irq(&events->lock);
+
+    q.nevents = n;
+    q.seq += n;
+    if (copy_to_user((char __user *) (unsigned long) q.buf, ring, n * sizeof(struct xstat_event)) ||
+            copy_to_user(uarg, &q, sizeof(q)))
+        ret = -EFAULT;
+    kfree(ring);
+    return ret;
+}
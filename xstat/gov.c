@@ -0,0 +1,189 @@
+// To be included in xstat.c after struct xstat_node
+
+#include <linux/cpufreq.h>
+
+// Counter-driven DVFS. With the governor attr on, each node sampler sorts its
+// records into compute- and memory-bound phases by LLC misses per 1000
+// instructions and IPC. Once a phase has held for gov_hyst records it sets the
+// clock of the node's CPUs: policy max for compute-bound phases, and for
+// memory-bound ones the lowest at which the modelled slowdown against policy
+// max stays within gov_loss percent. The model takes busy time not spent on
+// LLC misses to scale with the clock, each miss stalling XSTAT_GOV_MISS_NS.
+// Meant to run with the userspace cpufreq governor; the clock the node had is
+// put back when the governor or sampling goes off.
+
+#define XSTAT_GOV_MPKI      10
+// IPC below 1.
+#define XSTAT_GOV_MIPC      1000
+#define XSTAT_GOV_MISS_NS   80
+
+enum xstat_phase {
+    XSTAT_PHASE_COMPUTE,
+    XSTAT_PHASE_MEMORY,
+};
+
+static const char *xstat_phase_names[] = {
+    [XSTAT_PHASE_COMPUTE] = "compute",
+    [XSTAT_PHASE_MEMORY] = "memory",
+};
+
+static bool xstat_gov_on;
+static unsigned int xstat_gov_hyst;
+static unsigned int xstat_gov_loss;
+
+static void xstat_gov_set(struct xstat_node *node, unsigned int khz) {
+    struct cpufreq_policy *policy;
+    int cpu;
+    for_each_cpu(cpu, node->mask) {
+        policy = cpufreq_cpu_get(cpu);
+        if (!policy)
+            continue;
+        cpufreq_driver_target(policy, khz, CPUFREQ_RELATION_L);
+        cpufreq_cpu_put(policy);
+    }
+    node->gov.khz = khz;
+}
+
+static void xstat_gov_stop(struct xstat_node *node) {
+    if (node->gov.active) {
+        xstat_gov_set(node, node->gov.orig_khz);
+        node->gov.active = false;
+    }
+}
+
+// Lowest clock in kHz at which busy time is at most gov_loss percent above
+// that at fmax: core / f + mem <= (1 + loss) * (core / fmax + mem), core being
+// the cycles that scale with the clock and mem the stall time in us. Both
+// are halved together while large, which leaves the clock alone and keeps
+// the products below within 64 bits.
+static unsigned int xstat_gov_target(uint64_t cyc, uint64_t miss,
+        unsigned int cur, unsigned int fmax) {
+    uint64_t mem, stall, core, tmax, den;
+    mem = div64_u64(miss * XSTAT_GOV_MISS_NS, 1000);
+    stall = div64_u64(mem * cur, 1000);
+    if (stall > cyc) {
+        stall = cyc;
+        mem = div64_u64(cyc * 1000, cur);
+    }
+    core = cyc - stall;
+    while (core > (1ULL << 40)) {
+        core >>= 1;
+        mem >>= 1;
+    }
+    tmax = div64_u64(core * 1000, fmax) + mem;
+    den = (100 + xstat_gov_loss) * tmax - 100 * mem;
+    if (den == 0)
+        return fmax;
+    return min_t(uint64_t, div64_u64(core * 100000, den), fmax);
+}
+
+// Called by the node sampler with the values of each tick.
+static void xstat_gov_update(struct xstat_node *node, const uint64_t *vals) {
+    struct xstat_layout *layout = node->layout;
+    struct xstat_gov *gov = &node->gov;
+    struct cpufreq_policy *policy;
+    uint64_t cyc, inst, miss;
+    unsigned int khz;
+    int phase;
+
+    if (!ACCESS_ONCE(xstat_gov_on)) {
+        xstat_gov_stop(node);
+        return;
+    }
+    cyc = vals[layout->first[counter_index(&cyc_counter)]];
+    inst = vals[layout->first[counter_index(&inst_counter)]];
+    miss = vals[layout->first[counter_index(&llcmiss_counter)]];
+    if (!cyc || !inst)
+        return;
+
+    if (div64_u64(miss * 1000, inst) >= XSTAT_GOV_MPKI &&
+            div64_u64(inst * 1000, cyc) < XSTAT_GOV_MIPC)
+        phase = XSTAT_PHASE_MEMORY;
+    else
+        phase = XSTAT_PHASE_COMPUTE;
+    if (phase != gov->next) {
+        gov->next = phase;
+        gov->held = 0;
+    }
+    if (gov->held < xstat_gov_hyst)
+        gov->held++;
+    if (gov->held < xstat_gov_hyst && gov->active)
+        return;
+
+    policy = cpufreq_cpu_get(cpumask_first(node->mask));
+    if (!policy)
+        return;
+    if (!gov->active) {
+        gov->orig_khz = policy->cur;
+        gov->khz = policy->cur;
+        gov->active = true;
+    }
+    if (gov->held >= xstat_gov_hyst) {
+        gov->phase = phase;
+        khz = policy->max;
+        if (phase == XSTAT_PHASE_MEMORY && policy->cur)
+            khz = max(xstat_gov_target(cyc, miss, policy->cur, policy->max), policy->min);
+        if (khz != gov->khz)
+            xstat_gov_set(node, khz);
+    }
+    cpufreq_cpu_put(policy);
+}
+
+// on or off, then phase and clock of each node the governor is driving.
+static ssize_t show_governor_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        char *buf) {
+    struct xstat_node *node;
+    int limit = PAGE_SIZE;
+    char *ptr = buf;
+    int ret, i;
+
+    ret = scnprintf(ptr, limit, "%s\n", xstat_gov_on ? "on" : "off");
+    ptr += ret;
+    limit -= ret;
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        node = xstat_nodes[i];
+        if (!node || !node->gov.active)
+            continue;
+        ret = scnprintf(ptr, limit, "node%d %s %u\n", i,
+                xstat_phase_names[node->gov.phase], node->gov.khz);
+        ptr += ret;
+        limit -= ret;
+    }
+    return ptr - buf;
+}
+
+static ssize_t store_governor_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        const char *buf,
+        size_t count) {
+    if (count >= 2 && strncmp(buf, "on", 2) == 0) {
+        xstat_gov_on = true;
+    }
+    if (count >= 3 && strncmp(buf, "off", 3) == 0) {
+        xstat_gov_on = false;
+    }
+    return count;
+}
+
+#define GOV_UINT_ATTR(aname, var, min, max) \
+static ssize_t show_##aname##_attr(struct class *class, \
+        struct class_attribute *attr, char *buf) { \
+    return sprintf(buf, "%u\n", var); \
+} \
+static ssize_t store_##aname##_attr(struct class *class, \
+        struct class_attribute *attr, const char *buf, size_t count) { \
+    unsigned long tmp; \
+    if (kstrtoul(buf, 0, &tmp) == 0 && tmp >= min && tmp <= max) \
+        var = tmp; \
+    return count; \
+}
+GOV_UINT_ATTR(gov_hyst, xstat_gov_hyst, 0, 1000)
+GOV_UINT_ATTR(gov_loss, xstat_gov_loss, 0, 100)
+
+#define XSTAT_GOV_CLASS_ATTRS \
+    __ATTR(governor, 0644, show_governor_attr, store_governor_attr), \
+    __ATTR(gov_hyst, 0644, show_gov_hyst_attr, store_gov_hyst_attr), \
+    __ATTR(gov_loss, 0644, show_gov_loss_attr, store_gov_loss_attr),
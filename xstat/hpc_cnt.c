@@ -3,12 +3,16 @@
 struct perf_event_config {
     uint32_t type;
     uint32_t config;
+    uint64_t config1;
+    bool pinned;
 };
 
 struct perf_counter_per_cpu {
     uint64_t total;
     uint64_t enabled;
     uint64_t running;
+    // Scaled count of the last tick.
+    uint64_t delta;
     struct perf_event *event;
 };
 
@@ -40,6 +44,8 @@ static int perf_init(const struct cpumask *mask, void *data, void **ctx) {
     pe_attr.type = cfg->type;
     pe_attr.size = sizeof(pe_attr);
     pe_attr.config = cfg->config;
+    pe_attr.config1 = cfg->config1;
+    pe_attr.pinned = cfg->pinned;
     pe_attr.sample_period = 0;
 
     i = 0;
@@ -79,7 +85,12 @@ static uint64_t perf_restart(void **ctx, uint64_t last) {
 
     for (i = 0; i < cpumask_weight(perf_ctx->mask); i++) {
         event = perf_ctx->events[i].event;
+        perf_ctx->events[i].delta = 0;
+        if (event && xstat_idle_skip(event->cpu)) {
+            continue;
+        }
         if (event) {
+            xstat_noise_read(event->cpu);
             ret = perf_event_read_value(event, &enabled, &running);
             if (ret < perf_ctx->events[i].total ||
                 enabled < perf_ctx->events[i].enabled ||
@@ -91,6 +102,7 @@ static uint64_t perf_restart(void **ctx, uint64_t last) {
                 if (tmp > perf_overflow_threshold) {
                 } else {
                     total += tmp;
+                    perf_ctx->events[i].delta = tmp;
                 }
             }
             perf_ctx->events[i].total = ret;
@@ -103,6 +115,38 @@ static uint64_t perf_restart(void **ctx, uint64_t last) {
 
 static void perf_reset(void **ctx) {}
 
+// count * enabled / running, for an event perf multiplexed, without
+// overflowing.
+static uint64_t perf_scale(uint64_t count, uint64_t enabled, uint64_t running) {
+    uint64_t q;
+    while (enabled > 0xffffffff) {
+        enabled >>= 1;
+        running >>= 1;
+    }
+    if (!running || running >= enabled)
+        return count;
+    q = div64_u64(count, running);
+    return q * enabled + div64_u64((count - q * running) * enabled, running);
+}
+
+// Running count of the event on cpu, for readers other than the sampler.
+static int perf_read_cpu(void *ctx, int cpu, uint64_t *count,
+        uint64_t *enabled, uint64_t *running) {
+    struct perf_counter_context *perf_ctx = (struct perf_counter_context *) ctx;
+    struct perf_event *event;
+    int i;
+    if (!perf_ctx)
+        return -ENODATA;
+    for (i = 0; i < cpumask_weight(perf_ctx->mask); i++) {
+        event = perf_ctx->events[i].event;
+        if (event && event->cpu == cpu) {
+            *count = perf_event_read_value(event, enabled, running);
+            return 0;
+        }
+    }
+    return -ENODATA;
+}
+
 #define PERF_RAW_CONFIG(name, code) static struct perf_event_config perf_##name##_data = { .type = PERF_TYPE_RAW, .config = code }
 PERF_RAW_CONFIG(cyc, 0x003c);
 PERF_RAW_CONFIG(inst, 0x00c0);
@@ -112,14 +156,23 @@ PERF_RAW_CONFIG(br, 0x00c4);
 PERF_RAW_CONFIG(brmiss, 0x00c5);
 PERF_RAW_CONFIG(l2lin, 0x07f4);
 
+// OFFCORE_RESPONSE (event 0xb7, umask 0x01); the response mask goes to
+// MSR_OFFCORE_RSP_0 through config1. Masks are ALL_DATA_RD (0x91) from the
+// Haswell-EP tables. With only two OFFCORE_RSP MSRs these three events are
+// multiplexed by perf and scaled in perf_restart.
+#define PERF_OFFCORE_CONFIG(name, rsp) static struct perf_event_config perf_##name##_data = { .type = PERF_TYPE_RAW, .config = 0x01b7, .config1 = rsp }
+PERF_OFFCORE_CONFIG(lcldram, 0x0604000091ULL);
+PERF_OFFCORE_CONFIG(rmtdram, 0x063f800091ULL);
+PERF_OFFCORE_CONFIG(rmthit, 0x183fc00091ULL);
+
 #define PERF_COUNTER(aname) static struct xstat_counter aname##_counter = { \
     .name = #aname, \
     .init = perf_init, \
     .exit = perf_exit, \
     .restart = perf_restart, \
     .reset = perf_reset, \
-    .scnprintf = NULL, \
-    .data = &perf_##aname##_data \
+    .data = &perf_##aname##_data, \
+    .flags = XSTAT_FIELD_DELTA \
 }
 PERF_COUNTER(cyc);
 PERF_COUNTER(inst);
@@ -128,3 +181,52 @@ PERF_COUNTER(llcmiss);
 PERF_COUNTER(br);
 PERF_COUNTER(brmiss);
 PERF_COUNTER(l2lin);
+
+#define PERF_LINE_SIZE 64
+
+// Remote DRAM lines are only known to come from "some other socket", so the
+// node-to-node row (xnode<N>, bytes read from node N) spreads them evenly
+// over the other online nodes. On the usual two-socket box the estimate is
+// exact. Local traffic is in lcldram.
+static int rmtdram_fields(struct xstat_field *fields, void *data) {
+    char name[XSTAT_FIELD_LEN];
+    int nid;
+    if (fields) {
+        xstat_field_init(&fields[0], "rmtdram", "", XSTAT_U64, 0);
+        for (nid = 0; nid < nr_node_ids; nid++) {
+            snprintf(name, sizeof(name), "xnode%d", nid);
+            xstat_field_init(&fields[1 + nid], name, "B", XSTAT_U64, 0);
+        }
+        for (nid = 0; nid <= nr_node_ids; nid++)
+            fields[nid].flags = XSTAT_FIELD_DELTA;
+    }
+    return 1 + nr_node_ids;
+}
+
+static void rmtdram_sample(void **ctx, uint64_t *vals) {
+    struct perf_counter_context *perf_ctx = (struct perf_counter_context *) *ctx;
+    int self = cpu_to_node(cpumask_first(perf_ctx->mask));
+    int npeers = num_online_nodes() - 1;
+    uint64_t lines = perf_restart(ctx, 0);
+    uint64_t bytes = 0;
+    int nid;
+
+    vals[0] = lines;
+    if (npeers > 0)
+        bytes = div_u64(lines * PERF_LINE_SIZE, npeers);
+    for (nid = 0; nid < nr_node_ids; nid++) {
+        vals[1 + nid] = (nid != self && node_online(nid)) ? bytes : 0;
+    }
+}
+
+PERF_COUNTER(lcldram);
+PERF_COUNTER(rmthit);
+static struct xstat_counter rmtdram_counter = {
+    .name = "rmtdram",
+    .init = perf_init,
+    .exit = perf_exit,
+    .fields = rmtdram_fields,
+    .reset = perf_reset,
+    .sample = rmtdram_sample,
+    .data = &perf_rmtdram_data
+};
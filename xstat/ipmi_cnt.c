@@ -1,15 +1,48 @@
 #include <linux/ipmi.h>
+#include <linux/kthread.h>
+#include <linux/wait.h>
+#include <asm/unaligned.h>
 
+#define IPMI_NAME_LEN	17
+
+enum {
+	IPMI_KIND_SENSOR,	// Get Sensor Reading
+	IPMI_KIND_DCMI_POWER,	// DCMI Get Power Reading
+};
+
+// A reading converts as y = (m * x + b * 10^bexp) * 10^rexp, where x is the
+// raw byte interpreted according to format (IPMI analog data format: 0
+// unsigned, 1 one's complement, 2 two's complement).
 struct ipmi_sensor_config {
-	char	name[XSTAT_CNT_LEN];
-	int16_t base;
+	char	name[IPMI_NAME_LEN];
+	uint8_t kind;
 	uint8_t sensor_number;
-	uint8_t mul;
+	uint8_t sensor_type;
+	uint8_t unit;
+	uint8_t format;
+	int16_t m;
+	int16_t b;
+	int8_t	bexp;
+	int8_t	rexp;
 };
 
+// The reading cache is filled by the poller thread and read by the node
+// samplers; ts is when sensor_reading was obtained, 0 if never.
 struct ipmi_sensor_ctx {
 	struct ipmi_sensor_config config;
 	uint8_t sensor_reading;
+	// DCMI: current, minimum, maximum and average W, 16 bits each from the
+	// lowest, the averaging window in ms and the BMC timestamp in s.
+	uint64_t power;
+	uint32_t power_window;
+	uint32_t power_ts;
+	// Consecutive failed DCMI requests.
+	int failures;
+	bool disabled;
+	bool pending;
+	long msgid;
+	uint64_t sent;
+	uint64_t ts;
 };
 
 struct ipmi_sensors_ctx {
@@ -21,11 +54,20 @@ struct ipmi_sensors_ctx {
 };
 
 static int xstat_ipmi_cnt_init(const struct cpumask *mask, void *data, void **ctx);
-static uint64_t xstat_ipmi_restart(void **_ctx, uint64_t last);
-static int xstat_ipmi_scnprintf(char *buf, int limit, uint64_t data, void **_ctx);
+static int xstat_ipmi_fields(struct xstat_field *fields, void *data);
+static void xstat_ipmi_sample(void **_ctx, uint64_t *vals);
 
-#define __IPMI_CTX(sname, snum, smul, sbase) { .config = { .name = #sname, .sensor_number = snum, .mul = smul, .base = sbase }, .sensor_reading = 0 }
-#define __IPMI_CNT(ctx) { .name = "ipmi", .init = xstat_ipmi_cnt_init, .exit = NULL, .restart = xstat_ipmi_restart, .reset = NULL, .scnprintf = xstat_ipmi_scnprintf, .data = &ctx }
+// The compiled tables give (raw + base) * mul, i.e. m = mul, b = base * mul.
+// SDR discovery replaces the factors of a sensor it finds in the repository.
+#define __IPMI_CTX(sname, snum, smul, sbase) { .config = { .name = #sname, .sensor_number = snum, .m = smul, .b = (sbase) * (smul) }, .sensor_reading = 0, .pending = false, .ts = 0 }
+#define __IPMI_GROUP(gname, actxs, n) { \
+	.lock = __SPIN_LOCK_UNLOCKED(gname.lock), \
+	.user = NULL, \
+	.msgid = 0, \
+	.nctxs = n, \
+	.ctxs = actxs, \
+}
+#define __IPMI_CNT(ctx) { .name = "ipmi", .init = xstat_ipmi_cnt_init, .exit = NULL, .fields = xstat_ipmi_fields, .sample = xstat_ipmi_sample, .data = &ctx, .scope = XSTAT_SCOPE_SYSTEM }
 #ifdef XSTAT_COOLR
 static struct ipmi_sensor_ctx xstat_sensor_ctxs[] = {
 	__IPMI_CTX(FAN1, 65, 100, 0),
@@ -102,10 +144,51 @@ static struct xstat_counter xstat_ipmi_cnts[] = {
 };
 #endif
 
-#define N_IPMI_CNTS	(sizeof(xstat_ipmi_cnts) / sizeof(xstat_ipmi_cnts[0]))
+
+// Group filled from the SDR repository according to ipmi_select, see
+// ipmi_sdr.c.
+#define IPMI_SDR_MAX_SELECT	64
+static struct ipmi_sensor_ctx sdr_ctxs[IPMI_SDR_MAX_SELECT];
+static struct ipmi_sensors_ctx sdr_group_ctx = __IPMI_GROUP(sdr_group_ctx, sdr_ctxs, 0);
+static struct xstat_counter xstat_sdr_cnt = __IPMI_CNT(sdr_group_ctx);
+
+// DCMI Get Power Reading goes through the same poller as the sensors. It
+// stays disabled until the BMC answered a probe, see xstat_dcmi_probe.
+static struct ipmi_sensor_ctx dcmi_ctxs[] = {
+	{ .config = { .name = "dcmi", .kind = IPMI_KIND_DCMI_POWER }, .disabled = true },
+};
+static struct ipmi_sensors_ctx dcmi_group_ctx = __IPMI_GROUP(dcmi_group_ctx, dcmi_ctxs, 1);
+
+// Every group the poller serves.
+static struct ipmi_sensors_ctx *xstat_ipmi_groups[] = {
+#ifdef XSTAT_COOLR
+	&xstat_group0_ctx,
+#endif
+#ifdef XSTAT_CHAMELEON
+	&cham_groupA_ctx,
+	&cham_groupB_ctx,
+	&cham_misc_ctx,
+#endif
+	&sdr_group_ctx,
+	&dcmi_group_ctx,
+};
+
+#define N_IPMI_GROUPS	(sizeof(xstat_ipmi_groups) / sizeof(xstat_ipmi_groups[0]))
 #define XSTAT_IPMI_MAGIC 0x7017beef
 
+#define IPMI_NETFN_SENSOR	0x04
+#define IPMI_GET_SENSOR_READING	0x2d
+#define IPMI_NETFN_DCMI		0x2c
+#define IPMI_DCMI_GROUP_ID	0xdc
+#define IPMI_DCMI_GET_POWER	0x02
+#define IPMI_DCMI_POWER_LEN	19
+#define IPMI_DCMI_ACTIVE	0x40
+#define IPMI_DCMI_MAX_FAILURES	5
+
 static struct ipmi_user_hndl xstat_ipmi_hndl;
+static void xstat_sdr_register(int intf);
+static void xstat_sdr_build(void);
+static void xstat_sdr_exit(void);
 
 static void xstat_register_bmc(int intf, struct device *dev) {
 	int err, i;
@@ -113,22 +196,85 @@ static void xstat_register_bmc(int intf, struct device *dev) {
 	struct ipmi_sensors_ctx *ctx;
 
 	err = ipmi_get_smi_info(intf, &smi_data);
-	for (i = 0; i < N_IPMI_CNTS; i++) {
-		ctx = (struct ipmi_sensors_ctx *) xstat_ipmi_cnts[i].data;
+	for (i = 0; i < N_IPMI_GROUPS; i++) {
+		ctx = xstat_ipmi_groups[i];
 		if (!ctx->user)
 			err = ipmi_create_user(intf, &xstat_ipmi_hndl, ctx, &ctx->user);
 	}
+	xstat_sdr_register(intf);
+}
+
+static DECLARE_WAIT_QUEUE_HEAD(xstat_ipmi_wq);
+static atomic_t xstat_ipmi_inflight = ATOMIC_INIT(0);
+static atomic_t xstat_ipmi_timeouts = ATOMIC_INIT(0);
+static atomic_t xstat_ipmi_errors = ATOMIC_INIT(0);
+static struct task_struct *xstat_ipmi_task;
+static unsigned int xstat_ipmi_period = 1000;	// ms between two polls of a sensor
+static unsigned int xstat_ipmi_max_inflight = 4;
+static unsigned int xstat_ipmi_timeout = 500;	// ms before a request is given up
+
+// Must be called with the group lock held.
+static void xstat_ipmi_complete(struct ipmi_sensor_ctx *ctx) {
+	ctx->pending = false;
+	atomic_dec(&xstat_ipmi_inflight);
+	wake_up(&xstat_ipmi_wq);
+}
+
+static void xstat_sensor_recv(struct ipmi_sensor_ctx *ctx, struct ipmi_recv_msg *msg) {
+	// data[0] is the completion code, bit 5 of data[2] marks the reading as
+	// unavailable.
+	if (msg->msg.data_len > 2 && msg->msg.data[0] == 0
+			&& !(msg->msg.data[2] & 0x20)) {
+		ctx->sensor_reading = msg->msg.data[1];
+		ctx->ts = get_time();
+	} else {
+		atomic_inc(&xstat_ipmi_errors);
+	}
+}
+
+// Must be called with the group lock held. A BMC that keeps failing the
+// power reading, whatever the reason, is not asked again.
+static void xstat_dcmi_failed(struct ipmi_sensor_ctx *ctx) {
+	if (++ctx->failures == IPMI_DCMI_MAX_FAILURES) {
+		printk(KERN_INFO "xstat: DCMI power reading failed %d times, disabled.\n",
+				ctx->failures);
+		ctx->disabled = true;
+	}
+}
+
+static void xstat_dcmi_recv(struct ipmi_sensor_ctx *ctx, struct ipmi_recv_msg *msg) {
+	uint8_t *data = msg->msg.data;
+	// cc, group id, current, min, max, average (16 bits each), timestamp,
+	// averaging period (32 bits each), state; all little endian.
+	if (msg->msg.data_len < IPMI_DCMI_POWER_LEN || data[0] != 0
+			|| !(data[18] & IPMI_DCMI_ACTIVE)) {
+		atomic_inc(&xstat_ipmi_errors);
+		xstat_dcmi_failed(ctx);
+		return;
+	}
+	ctx->failures = 0;
+	ctx->power = get_unaligned_le64(&data[2]);
+	ctx->power_ts = get_unaligned_le32(&data[10]);
+	ctx->power_window = get_unaligned_le32(&data[14]);
+	ctx->ts = get_time();
 }
 
 static void xstat_ipmi_msg_handler(struct ipmi_recv_msg *msg, void *user_msg_data) {
 	struct ipmi_sensors_ctx *root_ctx = (struct ipmi_sensors_ctx *) user_msg_data;
 	struct ipmi_sensor_ctx *ctx;
+	unsigned long flags;
 	if (msg->user_msg_data && msg->user_msg_data >= (void *) root_ctx->ctxs
 			               && msg->user_msg_data < (void *) (root_ctx->ctxs + root_ctx->nctxs)) {
 		ctx = (struct ipmi_sensor_ctx *) msg->user_msg_data;
-		if (msg->msg.data_len > 2) {
-			ctx->sensor_reading = msg->msg.data[1];
+		spin_lock_irqsave(&root_ctx->lock, flags);
+		if (ctx->pending && ctx->msgid == msg->msgid) {
+			if (ctx->config.kind == IPMI_KIND_DCMI_POWER)
+				xstat_dcmi_recv(ctx, msg);
+			else
+				xstat_sensor_recv(ctx, msg);
+			xstat_ipmi_complete(ctx);
 		}
+		spin_unlock_irqrestore(&root_ctx->lock, flags);
 	} else {
 		printk(KERN_INFO "xstat:recv invalid ipmi msg: %016llx.\n", (uint64_t) msg->user_msg_data);
 	}
@@ -152,49 +298,272 @@ static int xstat_ipmi_cnt_init(const struct cpumask *mask, void *data, void **ct
 	return 0;
 }
 
-static uint64_t xstat_ipmi_restart(void **_ctx, uint64_t last) {
-	struct ipmi_sensors_ctx *ctx = (struct ipmi_sensors_ctx *) *_ctx;
-	ipmi_user_t user;
-	struct kernel_ipmi_msg msg;
-	int i, err, msgid;
-	struct ipmi_sensor_ctx *sctx;
-	uint64_t ret = 0;
-	user = ctx->user;
-	msg.netfn = 0x04;
-	msg.cmd = 0x2d;
-	msg.data_len = 1;
-	for (i = ctx->nctxs - 1; i >= 0; i--) {
-		if (i != ctx->nctxs - 1) ret <<= 8;
-		sctx = &ctx->ctxs[i];
-		if (user) {
-			msg.data = &sctx->config.sensor_number;
-			spin_lock(&ctx->lock);
-			msgid = ctx->msgid++;
-			spin_unlock(&ctx->lock);
-			err = ipmi_request_settime(user, &xstat_ipmi_address, msgid, &msg, sctx, 0 ,0, 0);
+// Time of the oldest reading in the cache, so a record tells how stale its
+// IPMI values can be; 0 while some sensor has never been read. Sensors the
+// BMC turned out not to have are left out.
+static uint64_t xstat_ipmi_ts_restart(void **_ctx, uint64_t last) {
+	struct ipmi_sensors_ctx *ctx;
+	uint64_t oldest = U64_MAX;
+	int i, j;
+	for (i = 0; i < N_IPMI_GROUPS; i++) {
+		ctx = xstat_ipmi_groups[i];
+		for (j = 0; j < ctx->nctxs; j++) {
+			if (!ctx->ctxs[j].disabled && ctx->ctxs[j].ts < oldest)
+				oldest = ctx->ctxs[j].ts;
+		}
+	}
+	return oldest == U64_MAX ? 0 : oldest;
+}
+
+static struct xstat_counter xstat_ipmi_ts_counter = __XSTAT_SCNT(ipmits, NULL, NULL, xstat_ipmi_ts_restart, NULL, XSTAT_SCOPE_SYSTEM);
+
+// No fields when the BMC has no DCMI power reading, or has not answered the
+// probe yet.
+static int xstat_dcmi_fields(struct xstat_field *fields, void *data) {
+	if (dcmi_ctxs[0].disabled)
+		return 0;
+	if (fields) {
+		xstat_field_init(&fields[0], "pwr", "W", XSTAT_U16, 0);
+		xstat_field_init(&fields[1], "pwrmin", "W", XSTAT_U16, 0);
+		xstat_field_init(&fields[2], "pwrmax", "W", XSTAT_U16, 0);
+		xstat_field_init(&fields[3], "pwravg", "W", XSTAT_U16, 0);
+		xstat_field_init(&fields[4], "pwrwin", "ms", XSTAT_U32, 0);
+		xstat_field_init(&fields[5], "pwrts", "s", XSTAT_U32, 0);
+	}
+	return 6;
+}
+
+static void xstat_dcmi_sample(void **_ctx, uint64_t *vals) {
+	uint64_t power = dcmi_ctxs[0].power;
+	vals[0] = power & 0xffff;
+	vals[1] = (power >> 16) & 0xffff;
+	vals[2] = (power >> 32) & 0xffff;
+	vals[3] = power >> 48;
+	vals[4] = dcmi_ctxs[0].power_window;
+	vals[5] = dcmi_ctxs[0].power_ts;
+}
+
+static struct xstat_counter xstat_dcmi_counter = __XSTAT_SMCNT(dcmi, NULL, NULL, xstat_dcmi_fields, xstat_dcmi_sample, XSTAT_SCOPE_SYSTEM);
+
+static bool xstat_ipmi_counter(struct xstat_counter *cnt) {
+	return cnt->sample == xstat_ipmi_sample || cnt == &xstat_ipmi_ts_counter ||
+		cnt == &xstat_dcmi_counter;
+}
+
+static int64_t xstat_ipmi_pow10(int64_t val, int exp) {
+	int64_t div = 1;
+	for (; exp > 0; exp--)
+		val *= 10;
+	for (; exp < 0; exp++)
+		div *= 10;
+	return div == 1 ? val : div64_s64(val, div);
+}
+
+// Reading in thousandths of the sensor unit.
+static int64_t xstat_ipmi_convert(const struct ipmi_sensor_config *cfg, uint8_t raw) {
+	int x;
+	switch (cfg->format) {
+	case 1:
+		x = (raw & 0x80) ? -(int) (~raw & 0xff) : raw;
+		break;
+	case 2:
+		x = (int8_t) raw;
+		break;
+	default:
+		x = raw;
+	}
+	return xstat_ipmi_pow10((int64_t) cfg->m * x, 3 + cfg->rexp)
+		+ xstat_ipmi_pow10((int64_t) cfg->b, 3 + cfg->bexp + cfg->rexp);
+}
+
+static const char *xstat_ipmi_unit(uint8_t unit) {
+	switch (unit) {
+	case 1: return "degC";
+	case 2: return "degF";
+	case 3: return "K";
+	case 4: return "V";
+	case 5: return "A";
+	case 6: return "W";
+	case 7: return "J";
+	case 18: return "RPM";
+	case 19: return "Hz";
+	default: return "";
+	}
+}
+
+// One field per sensor in thousandths of its unit.
+static int xstat_ipmi_fields(struct xstat_field *fields, void *data) {
+	struct ipmi_sensors_ctx *ctx = (struct ipmi_sensors_ctx *) data;
+	struct ipmi_sensor_config *cfg;
+	int i;
+	if (fields) {
+		for (i = 0; i < ctx->nctxs; i++) {
+			cfg = &ctx->ctxs[i].config;
+			xstat_field_init(&fields[i], cfg->name, xstat_ipmi_unit(cfg->unit),
+					XSTAT_S32, -3);
 		}
-		ret |= sctx->sensor_reading;
 	}
-	return ret;
+	return ctx->nctxs;
 }
 
-static int xstat_ipmi_scnprintf(char *buf, int limit, uint64_t data, void **_ctx) {
+static void xstat_ipmi_sample(void **_ctx, uint64_t *vals) {
 	struct ipmi_sensors_ctx *ctx = (struct ipmi_sensors_ctx *) *_ctx;
-	int val;
 	int i;
-	int ret;
-	char *ptr = buf;
 	for (i = 0; i < ctx->nctxs; i++) {
-		val = data & 0xff;
-		val += ctx->ctxs[i].config.base;
-		data >>= 8;
-		val *= ctx->ctxs[i].config.mul;
-		if (i == 0) {
-			ret = scnprintf(ptr, limit, "\"%s\":%d", ctx->ctxs[i].config.name, val);
-			ptr += ret;
-			limit -= ret;
-		} else {
-			ret = scnprintf(ptr, limit, ",\"%s\":%d", ctx->ctxs[i].config.name, val);
+		vals[i] = xstat_ipmi_convert(&ctx->ctxs[i].config, ctx->ctxs[i].sensor_reading);
+	}
+}
+
+// Gives up on requests the IPMI layer did not time out by itself.
+static void xstat_ipmi_expire(struct ipmi_sensors_ctx *ctx, uint64_t now) {
+	uint64_t timeout = (uint64_t) xstat_ipmi_timeout * 1000000;
+	unsigned long flags;
+	int i;
+	spin_lock_irqsave(&ctx->lock, flags);
+	for (i = 0; i < ctx->nctxs; i++) {
+		if (ctx->ctxs[i].pending && now - ctx->ctxs[i].sent > timeout) {
+			atomic_inc(&xstat_ipmi_timeouts);
+			if (ctx->ctxs[i].config.kind == IPMI_KIND_DCMI_POWER)
+				xstat_dcmi_failed(&ctx->ctxs[i]);
+			xstat_ipmi_complete(&ctx->ctxs[i]);
+		}
+	}
+	spin_unlock_irqrestore(&ctx->lock, flags);
+}
+
+static void xstat_ipmi_expire_all(uint64_t now) {
+	int i;
+	for (i = 0; i < N_IPMI_GROUPS; i++)
+		xstat_ipmi_expire(xstat_ipmi_groups[i], now);
+}
+
+static void xstat_ipmi_send(struct ipmi_sensors_ctx *ctx, struct ipmi_sensor_ctx *sctx) {
+	// mode 1: system power statistics
+	uint8_t dcmi_req[4] = { IPMI_DCMI_GROUP_ID, 0x01, 0x00, 0x00 };
+	struct kernel_ipmi_msg msg;
+	unsigned long flags;
+	long msgid;
+	int err;
+
+	if (sctx->config.kind == IPMI_KIND_DCMI_POWER) {
+		msg.netfn = IPMI_NETFN_DCMI;
+		msg.cmd = IPMI_DCMI_GET_POWER;
+		msg.data_len = sizeof(dcmi_req);
+		msg.data = dcmi_req;
+	} else {
+		msg.netfn = IPMI_NETFN_SENSOR;
+		msg.cmd = IPMI_GET_SENSOR_READING;
+		msg.data_len = 1;
+		msg.data = &sctx->config.sensor_number;
+	}
+
+	spin_lock_irqsave(&ctx->lock, flags);
+	if (!ctx->user || sctx->pending || sctx->disabled) {
+		spin_unlock_irqrestore(&ctx->lock, flags);
+		return;
+	}
+	msgid = ctx->msgid++;
+	sctx->msgid = msgid;
+	sctx->sent = get_time();
+	sctx->pending = true;
+	atomic_inc(&xstat_ipmi_inflight);
+	spin_unlock_irqrestore(&ctx->lock, flags);
+
+	// No retries: a timed out request comes back with an error completion
+	// code and the sensor is simply asked again next round.
+	err = ipmi_request_settime(ctx->user, &xstat_ipmi_address, msgid, &msg, sctx,
+			0, 0, xstat_ipmi_timeout);
+	if (err) {
+		atomic_inc(&xstat_ipmi_errors);
+		spin_lock_irqsave(&ctx->lock, flags);
+		if (sctx->pending && sctx->msgid == msgid) {
+			if (sctx->config.kind == IPMI_KIND_DCMI_POWER)
+				xstat_dcmi_failed(sctx);
+			xstat_ipmi_complete(sctx);
+		}
+		spin_unlock_irqrestore(&ctx->lock, flags);
+	}
+}
+
+static bool xstat_ipmi_slot_free(void) {
+	return atomic_read(&xstat_ipmi_inflight) < xstat_ipmi_max_inflight
+		|| kthread_should_stop();
+}
+
+// Polls every sensor once per xstat_ipmi_period with at most
+// xstat_ipmi_max_inflight requests outstanding. The node samplers never talk
+// to the BMC, they only read the cache.
+static int xstat_ipmi_poll(void *data) {
+	struct ipmi_sensors_ctx *ctx;
+	uint64_t round;
+	long tosleep;
+	int i, j;
+
+	while (!kthread_should_stop()) {
+		round = get_time();
+		for (i = 0; i < N_IPMI_GROUPS && !kthread_should_stop(); i++) {
+			ctx = xstat_ipmi_groups[i];
+			for (j = 0; j < ctx->nctxs && !kthread_should_stop(); j++) {
+				if (ctx->ctxs[j].disabled)
+					continue;
+				while (!wait_event_interruptible_timeout(xstat_ipmi_wq, xstat_ipmi_slot_free(),
+							msecs_to_jiffies(xstat_ipmi_timeout))) {
+					xstat_ipmi_expire_all(get_time());
+				}
+				xstat_ipmi_send(ctx, &ctx->ctxs[j]);
+			}
+		}
+		tosleep = xstat_ipmi_period - (long) ((get_time() - round) / 1000000);
+		if (tosleep > 0)
+			wait_event_interruptible_timeout(xstat_ipmi_wq, kthread_should_stop(),
+					msecs_to_jiffies(tosleep));
+	}
+	return 0;
+}
+
+static void xstat_ipmi_start(void) {
+	if (xstat_ipmi_task)
+		return;
+	xstat_sdr_build();
+	xstat_ipmi_task = kthread_run(xstat_ipmi_poll, NULL, "xstat_ipmi");
+	if (IS_ERR(xstat_ipmi_task))
+		xstat_ipmi_task = NULL;
+}
+
+static void xstat_ipmi_stop(void) {
+	if (xstat_ipmi_task) {
+		kthread_stop(xstat_ipmi_task);
+		xstat_ipmi_task = NULL;
+		// Late responses to what is still outstanding are dropped.
+		xstat_ipmi_expire_all(U64_MAX);
+	}
+}
+
+static ssize_t show_ipmi_attr(
+		struct class *class,
+		struct class_attribute *attr,
+		char *buf) {
+	struct ipmi_sensors_ctx *ctx;
+	uint64_t now = get_time();
+	int limit = PAGE_SIZE;
+	char *ptr = buf;
+	int ret, i, j;
+
+	ret = scnprintf(ptr, limit, "inflight %d timeouts %d errors %d\n",
+			atomic_read(&xstat_ipmi_inflight), atomic_read(&xstat_ipmi_timeouts),
+			atomic_read(&xstat_ipmi_errors));
+	ptr += ret;
+	limit -= ret;
+	for (i = 0; i < N_IPMI_GROUPS; i++) {
+		ctx = xstat_ipmi_groups[i];
+		for (j = 0; j < ctx->nctxs; j++) {
+			// name, raw reading, when it was obtained and its age in ms
+			ret = scnprintf(ptr, limit, "%s %llu %llu %llu\n",
+					ctx->ctxs[j].config.name,
+					ctx->ctxs[j].config.kind == IPMI_KIND_DCMI_POWER ?
+						ctx->ctxs[j].power : ctx->ctxs[j].sensor_reading,
+					ctx->ctxs[j].ts,
+					ctx->ctxs[j].ts ? (now - ctx->ctxs[j].ts) / 1000000 : 0);
 			ptr += ret;
 			limit -= ret;
 		}
@@ -202,6 +571,29 @@ static int xstat_ipmi_scnprintf(char *buf, int limit, uint64_t data, void **_ctx
 	return ptr - buf;
 }
 
+#define IPMI_UINT_ATTR(aname, var, min, max) \
+static ssize_t show_##aname##_attr(struct class *class, \
+		struct class_attribute *attr, char *buf) { \
+	return sprintf(buf, "%u\n", var); \
+} \
+static ssize_t store_##aname##_attr(struct class *class, \
+		struct class_attribute *attr, const char *buf, size_t count) { \
+	unsigned long tmp; \
+	if (kstrtoul(buf, 0, &tmp) == 0 && tmp >= min && tmp <= max) \
+		var = tmp; \
+	return count; \
+}
+IPMI_UINT_ATTR(ipmi_period, xstat_ipmi_period, 10, 600000)
+IPMI_UINT_ATTR(ipmi_inflight, xstat_ipmi_max_inflight, 1, 64)
+IPMI_UINT_ATTR(ipmi_timeout, xstat_ipmi_timeout, 10, 60000)
+
+#define XSTAT_IPMI_CLASS_ATTRS \
+	__ATTR(ipmi, 0444, show_ipmi_attr, NULL), \
+	__ATTR(ipmi_period, 0644, show_ipmi_period_attr, store_ipmi_period_attr), \
+	__ATTR(ipmi_inflight, 0644, show_ipmi_inflight_attr, store_ipmi_inflight_attr), \
+	__ATTR(ipmi_timeout, 0644, show_ipmi_timeout_attr, store_ipmi_timeout_attr), \
+	XSTAT_SDR_CLASS_ATTRS
+
 static int xstat_ipmi_init(void) {
 	xstat_ipmi_address.addr_type = IPMI_SYSTEM_INTERFACE_ADDR_TYPE;
 	xstat_ipmi_address.channel = IPMI_BMC_CHANNEL;
@@ -214,15 +606,16 @@ static void xstat_ipmi_exit(void) {
 	int i;
 	ipmi_user_t user = NULL;
 	struct ipmi_sensors_ctx *ctx;
-	for (i = 0; i < N_IPMI_CNTS; i++) {
-		ctx = (struct ipmi_sensors_ctx *) xstat_ipmi_cnts[i].data;
-		spin_lock(&ctx->lock);
+	unsigned long flags;
+	xstat_ipmi_stop();
+	xstat_sdr_exit();
+	for (i = 0; i < N_IPMI_GROUPS; i++) {
+		ctx = xstat_ipmi_groups[i];
+		spin_lock_irqsave(&ctx->lock, flags);
 		user = ctx->user;
 		ctx->user = 0;
-		spin_unlock(&ctx->lock);
+		spin_unlock_irqrestore(&ctx->lock, flags);
 		if (user) ipmi_destroy_user(user);
 	}
 	ipmi_smi_watcher_unregister(&xstat_ipmi_watcher);
 }
-
-
@@ -0,0 +1,439 @@
+// To be included in xstat.c after ipmi_cnt.c
+
+#include <linux/completion.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+
+// Walks the BMC's SDR repository (IPMI v2.0 section 33) once a BMC shows up.
+// Full sensor records give the sensor number, type, unit and linear
+// conversion factors. The discovered table feeds the SDR group of
+// ipmi_cnt.c, picked by name or type through ipmi_select, and corrects the
+// factors of the compiled site tables. The same walk first probes the DCMI
+// power reading.
+
+#define IPMI_NETFN_STORAGE	0x0a
+#define IPMI_GET_SDR_REPO_INFO	0x20
+#define IPMI_RESERVE_SDR_REPO	0x22
+#define IPMI_GET_SDR		0x23
+#define IPMI_CC_RESV_CANCELLED	0xc5
+
+#define IPMI_SDR_FULL_SENSOR	0x01
+#define IPMI_SDR_THRESHOLD	0x01
+#define IPMI_SDR_NO_ANALOG	3
+#define IPMI_SDR_HEADER_LEN	5
+#define IPMI_SDR_FULL_MIN_LEN	48
+#define IPMI_SDR_MAX_LEN	64
+#define IPMI_SDR_CHUNK		16
+#define IPMI_SDR_MAX_SENSORS	256
+#define IPMI_SDR_LAST_ID	0xffff
+#define IPMI_SDR_SELECT_LEN	256
+#define IPMI_SYNC_TIMEOUT	5000
+
+struct ipmi_sync_req {
+	struct completion done;
+	long msgid;
+	int len;
+	uint8_t data[IPMI_MAX_MSG_LENGTH];
+};
+
+static ipmi_user_t xstat_sdr_user;
+static struct ipmi_sync_req xstat_sdr_req;
+static DEFINE_SPINLOCK(xstat_sdr_req_lock);
+static long xstat_sdr_msgid;
+static struct work_struct xstat_sdr_work;
+
+// Protects the discovered table and the selection.
+static DEFINE_MUTEX(xstat_sdr_mutex);
+static struct ipmi_sensor_config *xstat_sdr_sensors;
+static int xstat_sdr_nsensors;
+static char xstat_sdr_select[IPMI_SDR_SELECT_LEN];
+
+static const struct {
+	const char *name;
+	uint8_t type;
+} xstat_sdr_types[] = {
+	{ "temp", 0x01 },
+	{ "volt", 0x02 },
+	{ "current", 0x03 },
+	{ "fan", 0x04 },
+	{ "psu", 0x08 },
+	{ "other", 0x0b },
+};
+
+static void xstat_sdr_msg_handler(struct ipmi_recv_msg *msg, void *user_msg_data) {
+	struct ipmi_sync_req *req = &xstat_sdr_req;
+	unsigned long flags;
+	spin_lock_irqsave(&xstat_sdr_req_lock, flags);
+	if (msg->msgid == req->msgid) {
+		req->len = min_t(int, msg->msg.data_len, sizeof(req->data));
+		memcpy(req->data, msg->msg.data, req->len);
+		complete(&req->done);
+	}
+	spin_unlock_irqrestore(&xstat_sdr_req_lock, flags);
+	msg->done(msg);
+}
+
+static struct ipmi_user_hndl xstat_sdr_hndl = {
+	.ipmi_recv_hndl = xstat_sdr_msg_handler,
+};
+
+// Sends one request and waits for its response. Returns the completion code
+// (0 on success) or a negative errno.
+static int xstat_sdr_request(uint8_t netfn, uint8_t cmd, uint8_t *data, int len) {
+	struct ipmi_sync_req *req = &xstat_sdr_req;
+	struct kernel_ipmi_msg msg;
+	unsigned long flags;
+	long msgid;
+	int err;
+
+	msg.netfn = netfn;
+	msg.cmd = cmd;
+	msg.data = data;
+	msg.data_len = len;
+
+	spin_lock_irqsave(&xstat_sdr_req_lock, flags);
+	msgid = ++xstat_sdr_msgid;
+	req->msgid = msgid;
+	req->len = 0;
+	init_completion(&req->done);
+	spin_unlock_irqrestore(&xstat_sdr_req_lock, flags);
+
+	err = ipmi_request_settime(xstat_sdr_user, &xstat_ipmi_address, msgid, &msg, req,
+			0, 3, 1000);
+	if (err)
+		return err;
+	if (!wait_for_completion_timeout(&req->done, msecs_to_jiffies(IPMI_SYNC_TIMEOUT)))
+		return -ETIMEDOUT;
+	if (req->len < 1)
+		return -EIO;
+	return req->data[0];
+}
+
+static int xstat_sdr_reserve(uint16_t *resv) {
+	int cc = xstat_sdr_request(IPMI_NETFN_STORAGE, IPMI_RESERVE_SDR_REPO, NULL, 0);
+	if (cc)
+		return cc < 0 ? cc : -EIO;
+	if (xstat_sdr_req.len < 3)
+		return -EIO;
+	*resv = xstat_sdr_req.data[1] | (xstat_sdr_req.data[2] << 8);
+	return 0;
+}
+
+// Reads len bytes at offset of record id, reserving again if another
+// requester cancelled our reservation.
+static int xstat_sdr_read(uint16_t *resv, uint16_t id, uint8_t offset, uint8_t len,
+		uint8_t *buf, uint16_t *next) {
+	uint8_t data[6];
+	int cc, err, tries;
+
+	for (tries = 0; tries < 3; tries++) {
+		data[0] = *resv & 0xff;
+		data[1] = *resv >> 8;
+		data[2] = id & 0xff;
+		data[3] = id >> 8;
+		data[4] = offset;
+		data[5] = len;
+		cc = xstat_sdr_request(IPMI_NETFN_STORAGE, IPMI_GET_SDR, data, sizeof(data));
+		if (cc == IPMI_CC_RESV_CANCELLED) {
+			err = xstat_sdr_reserve(resv);
+			if (err)
+				return err;
+			continue;
+		}
+		if (cc)
+			return cc < 0 ? cc : -EIO;
+		if (xstat_sdr_req.len < 3 + len)
+			return -EIO;
+		*next = xstat_sdr_req.data[1] | (xstat_sdr_req.data[2] << 8);
+		memcpy(buf, &xstat_sdr_req.data[3], len);
+		return 0;
+	}
+	return -EBUSY;
+}
+
+static int16_t xstat_sdr_10bit(uint8_t ls, uint8_t ms) {
+	int16_t val = ls | ((ms & 0xc0) << 2);
+	if (val & 0x200)
+		val -= 0x400;
+	return val;
+}
+
+static int8_t xstat_sdr_4bit(uint8_t val) {
+	val &= 0xf;
+	return (val & 0x8) ? (int8_t) val - 16 : val;
+}
+
+// Fills cfg from a full sensor record. Returns false for sensors that do not
+// use the linear formula, discrete sensors and those without an analog
+// reading, whose bytes are state bits rather than a value.
+static bool xstat_sdr_parse_full(const uint8_t *rec, int len, struct ipmi_sensor_config *cfg) {
+	int idlen;
+
+	if (rec[13] != IPMI_SDR_THRESHOLD || (rec[20] >> 6) == IPMI_SDR_NO_ANALOG ||
+			(rec[23] & 0x7f) != 0)
+		return false;
+
+	memset(cfg, 0, sizeof(*cfg));
+	cfg->sensor_number = rec[7];
+	cfg->sensor_type = rec[12];
+	cfg->format = rec[20] >> 6;
+	cfg->unit = rec[21];
+	cfg->m = xstat_sdr_10bit(rec[24], rec[25]);
+	cfg->b = xstat_sdr_10bit(rec[26], rec[27]);
+	cfg->rexp = xstat_sdr_4bit(rec[29] >> 4);
+	cfg->bexp = xstat_sdr_4bit(rec[29]);
+
+	idlen = rec[47] & 0x1f;
+	if (idlen > len - IPMI_SDR_FULL_MIN_LEN)
+		idlen = len - IPMI_SDR_FULL_MIN_LEN;
+	if (idlen > IPMI_NAME_LEN - 1)
+		idlen = IPMI_NAME_LEN - 1;
+	memcpy(cfg->name, &rec[48], idlen);
+	cfg->name[idlen] = '\0';
+	return true;
+}
+
+// The compiled site tables keep their names but take the repository's
+// conversion for the sensor numbers it knows. Like xstat_sdr_build, only
+// called while sampling is off.
+static void xstat_sdr_update_tables(void) {
+	struct ipmi_sensors_ctx *ctx;
+	struct ipmi_sensor_config *cfg;
+	int i, j, k;
+
+	for (i = 0; i < N_IPMI_GROUPS; i++) {
+		ctx = xstat_ipmi_groups[i];
+		if (ctx == &sdr_group_ctx)
+			continue;
+		for (j = 0; j < ctx->nctxs; j++) {
+			cfg = &ctx->ctxs[j].config;
+			if (cfg->kind != IPMI_KIND_SENSOR)
+				continue;
+			for (k = 0; k < xstat_sdr_nsensors; k++) {
+				if (xstat_sdr_sensors[k].sensor_number != cfg->sensor_number)
+					continue;
+				cfg->sensor_type = xstat_sdr_sensors[k].sensor_type;
+				cfg->unit = xstat_sdr_sensors[k].unit;
+				cfg->format = xstat_sdr_sensors[k].format;
+				cfg->m = xstat_sdr_sensors[k].m;
+				cfg->b = xstat_sdr_sensors[k].b;
+				cfg->bexp = xstat_sdr_sensors[k].bexp;
+				cfg->rexp = xstat_sdr_sensors[k].rexp;
+				break;
+			}
+		}
+	}
+}
+
+// The DCMI counter only gets its fields once the BMC gave a power reading.
+static void xstat_dcmi_probe(void) {
+	// mode 1: system power statistics
+	uint8_t data[4] = { IPMI_DCMI_GROUP_ID, 0x01, 0x00, 0x00 };
+
+	if (xstat_sdr_request(IPMI_NETFN_DCMI, IPMI_DCMI_GET_POWER, data, sizeof(data)) != 0 ||
+			xstat_sdr_req.len < IPMI_DCMI_POWER_LEN) {
+		printk(KERN_INFO "xstat: BMC does not support DCMI power reading.\n");
+		return;
+	}
+	dcmi_ctxs[0].disabled = false;
+}
+
+static void xstat_sdr_scan(struct work_struct *work) {
+	struct ipmi_sensor_config *sensors;
+	uint8_t rec[IPMI_SDR_MAX_LEN];
+	uint16_t resv, id, next;
+	int n = 0, rlen, off, chunk, err;
+
+	xstat_dcmi_probe();
+	if (xstat_sdr_request(IPMI_NETFN_STORAGE, IPMI_GET_SDR_REPO_INFO, NULL, 0) != 0) {
+		printk(KERN_INFO "xstat: no IPMI SDR repository.\n");
+		return;
+	}
+	if (xstat_sdr_reserve(&resv))
+		return;
+
+	sensors = kcalloc(IPMI_SDR_MAX_SENSORS, sizeof(*sensors), GFP_KERNEL);
+	if (!sensors)
+		return;
+
+	for (id = 0; id != IPMI_SDR_LAST_ID && n < IPMI_SDR_MAX_SENSORS; id = next) {
+		err = xstat_sdr_read(&resv, id, 0, IPMI_SDR_HEADER_LEN, rec, &next);
+		if (err)
+			break;
+		rlen = rec[4];
+		if (rlen > IPMI_SDR_MAX_LEN - IPMI_SDR_HEADER_LEN)
+			rlen = IPMI_SDR_MAX_LEN - IPMI_SDR_HEADER_LEN;
+		if (rec[3] != IPMI_SDR_FULL_SENSOR)
+			continue;
+		for (off = 0; off < rlen && !err; off += chunk) {
+			chunk = min(IPMI_SDR_CHUNK, rlen - off);
+			err = xstat_sdr_read(&resv, id, IPMI_SDR_HEADER_LEN + off, chunk,
+					&rec[IPMI_SDR_HEADER_LEN + off], &next);
+		}
+		if (err)
+			break;
+		if (IPMI_SDR_HEADER_LEN + rlen >= IPMI_SDR_FULL_MIN_LEN &&
+				xstat_sdr_parse_full(rec, IPMI_SDR_HEADER_LEN + rlen, &sensors[n]))
+			n++;
+	}
+
+	mutex_lock(&xstat_sdr_mutex);
+	kfree(xstat_sdr_sensors);
+	xstat_sdr_sensors = sensors;
+	xstat_sdr_nsensors = n;
+	mutex_unlock(&xstat_sdr_mutex);
+	printk(KERN_INFO "xstat: %d IPMI sensors discovered.\n", n);
+}
+
+static void xstat_sdr_register(int intf) {
+	if (xstat_sdr_user)
+		return;
+	INIT_WORK(&xstat_sdr_work, xstat_sdr_scan);
+	if (ipmi_create_user(intf, &xstat_sdr_hndl, NULL, &xstat_sdr_user))
+		return;
+	schedule_work(&xstat_sdr_work);
+}
+
+static bool xstat_sdr_match(const struct ipmi_sensor_config *cfg, const char *tok, int len) {
+	unsigned long type;
+	char num[4];
+	int i;
+
+	if (len > 5 && strncmp(tok, "type:", 5) == 0) {
+		tok += 5;
+		len -= 5;
+		for (i = 0; i < ARRAY_SIZE(xstat_sdr_types); i++) {
+			if (strlen(xstat_sdr_types[i].name) == len &&
+					strncmp(xstat_sdr_types[i].name, tok, len) == 0)
+				return cfg->sensor_type == xstat_sdr_types[i].type;
+		}
+		if (len >= sizeof(num))
+			return false;
+		memcpy(num, tok, len);
+		num[len] = '\0';
+		return kstrtoul(num, 0, &type) == 0 && cfg->sensor_type == type;
+	}
+	return strlen(cfg->name) == len && strncmp(cfg->name, tok, len) == 0;
+}
+
+// An empty selection takes the sensors of the types named in
+// xstat_sdr_types.
+static bool xstat_sdr_selected(const struct ipmi_sensor_config *cfg) {
+	const char *tok = xstat_sdr_select;
+	const char *end;
+	int i;
+
+	if (!*tok) {
+		for (i = 0; i < ARRAY_SIZE(xstat_sdr_types); i++) {
+			if (cfg->sensor_type == xstat_sdr_types[i].type)
+				return true;
+		}
+		return false;
+	}
+	while (*tok) {
+		end = strchrnul(tok, ',');
+		if (xstat_sdr_match(cfg, tok, end - tok))
+			return true;
+		tok = *end ? end + 1 : end;
+	}
+	return false;
+}
+
+// Fills the SDR group with the selected sensors and applies the last scan to
+// the site tables. Only called while sampling is off, so neither the poller
+// nor the samplers look at them, and the layout is built afterwards. Waits
+// for a scan still running, which also settles the DCMI fields.
+static void xstat_sdr_build(void) {
+	struct ipmi_sensor_ctx *sctx;
+	int i, n = 0, skipped = 0;
+
+	if (xstat_sdr_user)
+		flush_work(&xstat_sdr_work);
+	mutex_lock(&xstat_sdr_mutex);
+	for (i = 0; i < xstat_sdr_nsensors; i++) {
+		if (!xstat_sdr_selected(&xstat_sdr_sensors[i]))
+			continue;
+		if (n == IPMI_SDR_MAX_SELECT) {
+			skipped++;
+			continue;
+		}
+		sctx = &sdr_ctxs[n];
+		memset(sctx, 0, sizeof(*sctx));
+		sctx->config = xstat_sdr_sensors[i];
+		n++;
+	}
+	sdr_group_ctx.nctxs = n;
+	xstat_sdr_update_tables();
+	mutex_unlock(&xstat_sdr_mutex);
+	if (skipped)
+		printk(KERN_WARNING "xstat: %d selected IPMI sensors over %d left out.\n",
+				skipped, IPMI_SDR_MAX_SELECT);
+}
+
+static void xstat_sdr_exit(void) {
+	if (xstat_sdr_user) {
+		cancel_work_sync(&xstat_sdr_work);
+		ipmi_destroy_user(xstat_sdr_user);
+		xstat_sdr_user = NULL;
+	}
+	kfree(xstat_sdr_sensors);
+	xstat_sdr_sensors = NULL;
+	xstat_sdr_nsensors = 0;
+}
+
+static ssize_t show_ipmi_sensors_attr(
+		struct class *class,
+		struct class_attribute *attr,
+		char *buf) {
+	struct ipmi_sensor_config *cfg;
+	int limit = PAGE_SIZE;
+	char *ptr = buf;
+	int ret, i;
+
+	mutex_lock(&xstat_sdr_mutex);
+	for (i = 0; i < xstat_sdr_nsensors; i++) {
+		cfg = &xstat_sdr_sensors[i];
+		// number, type, unit, format, M, B, B exponent, R exponent, name
+		ret = scnprintf(ptr, limit, "%u %u %u %u %d %d %d %d %s\n",
+				cfg->sensor_number, cfg->sensor_type, cfg->unit, cfg->format,
+				cfg->m, cfg->b, cfg->bexp, cfg->rexp, cfg->name);
+		ptr += ret;
+		limit -= ret;
+	}
+	mutex_unlock(&xstat_sdr_mutex);
+	return ptr - buf;
+}
+
+static ssize_t show_ipmi_select_attr(
+		struct class *class,
+		struct class_attribute *attr,
+		char *buf) {
+	ssize_t ret;
+	mutex_lock(&xstat_sdr_mutex);
+	ret = sprintf(buf, "%s\n", xstat_sdr_select);
+	mutex_unlock(&xstat_sdr_mutex);
+	return ret;
+}
+
+// Comma separated sensor names and type:<name|number> entries. Takes effect
+// when sampling is next turned on.
+static ssize_t store_ipmi_select_attr(
+		struct class *class,
+		struct class_attribute *attr,
+		const char *buf,
+		size_t count) {
+	size_t len = count;
+	if (len > 0 && buf[len - 1] == '\n')
+		len--;
+	if (len >= IPMI_SDR_SELECT_LEN)
+		return -EINVAL;
+	mutex_lock(&xstat_sdr_mutex);
+	memcpy(xstat_sdr_select, buf, len);
+	xstat_sdr_select[len] = '\0';
+	mutex_unlock(&xstat_sdr_mutex);
+	return count;
+}
+
+#define XSTAT_SDR_CLASS_ATTRS \
+	__ATTR(ipmi_sensors, 0444, show_ipmi_sensors_attr, NULL), \
+	__ATTR(ipmi_select, 0644, show_ipmi_select_attr, store_ipmi_select_attr),
@@ -0,0 +1,38 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#include "libxstat.h"
+
+// Regions belong to an open file, so each thread opens its own. Any node's
+// device will do: counts are those of the calling CPU.
+static __thread int xstat_fd = -1;
+
+static int xstat_region(unsigned int id, unsigned int op, struct xstat_region *q) {
+    if (xstat_fd < 0) {
+        xstat_fd = open("/dev/xstat0", O_RDONLY);
+        if (xstat_fd < 0)
+            return -1;
+    }
+    memset(q, 0, sizeof(*q));
+    q->id = id;
+    q->op = op;
+    return ioctl(xstat_fd, XSTAT_IOC_REGION, q) < 0 ? -1 : 0;
+}
+
+int xstat_begin(unsigned int id) {
+    struct xstat_region q;
+    return xstat_region(id, XSTAT_REGION_BEGIN, &q);
+}
+
+int xstat_end(unsigned int id, struct xstat_region *out) {
+    return xstat_region(id, XSTAT_REGION_END, out);
+}
+
+void xstat_close(void) {
+    if (xstat_fd >= 0) {
+        close(xstat_fd);
+        xstat_fd = -1;
+    }
+}
@@ -0,0 +1,26 @@
+#ifndef _LIBXSTAT_H_
+#define _LIBXSTAT_H_
+
+// Region counters from the xstat module: cycles, instructions, LLC misses
+// and package energy between xstat_begin and xstat_end on the calling thread,
+// which should stay on one CPU. Sampling has to be on. Each thread opens
+// /dev/xstat0 read-only, which the module creates readable by all users.
+
+#include "xstat_ioctl.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// id is below XSTAT_NREGION. Return 0, or -1 with errno set.
+int xstat_begin(unsigned int id);
+int xstat_end(unsigned int id, struct xstat_region *out);
+
+// Closes the device the calling thread opened, if any.
+void xstat_close(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
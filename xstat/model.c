@@ -0,0 +1,155 @@
+// To be included in xstat.c after struct xstat_node
+
+// Per-CPU power model, fitted online. Power is taken as a bias plus a linear
+// function of each CPU's cycles, instructions, LLC misses and cycles times
+// clock, all as rates. Every tick the weights take one normalized LMS step
+// toward the RAPL power of the node's share of its package; snapshots, markers
+// and short ticks are not fitted on. Records get the model's power for the
+// node and its mean relative error; the model attr shows the latest estimate
+// of each CPU. Without RAPL nothing is fitted: the estimates come from
+// weights written to the model attr, say from a calibration run on the same
+// hardware, and estimated is set.
+
+#define XSTAT_MODEL_NX      5
+// Weights are Q16 mW per unit of feature. Features are in M/s, cycles times
+// clock in M/s * GHz, and the bias features of a node add up to
+// XSTAT_MODEL_BIAS.
+#define XSTAT_MODEL_SHIFT   16
+#define XSTAT_MODEL_BIAS    1000
+// Step size, 2^-XSTAT_MODEL_MU.
+#define XSTAT_MODEL_MU      3
+
+struct xstat_model {
+    int64_t w[XSTAT_MODEL_NX];
+    // Relative error per mille, averaged over about 8 ticks.
+    int err;
+};
+
+static struct xstat_model xstat_models[MAX_NUMNODES];
+// mW of each CPU in the last tick of its node.
+static DEFINE_PER_CPU(uint32_t, xstat_model_cpupwr);
+static bool xstat_rapl;
+
+static int model_init(const struct cpumask *mask, void *data, void **ctx) {
+    uint64_t tmp;
+    *ctx = xstat_nodes[cpu_to_node(cpumask_first(mask))];
+    xstat_rapl = rdmsrl_safe(MSR_PKG_ENERGY_STATUS, &tmp) == 0;
+    return 0;
+}
+
+static int model_fields(struct xstat_field *fields, void *data) {
+    if (fields) {
+        xstat_field_init(&fields[0], "estpwr", "W", XSTAT_U32, -3);
+        xstat_field_init(&fields[1], "modelerr", "", XSTAT_U16, -3);
+        xstat_field_init(&fields[2], "estimated", "", XSTAT_U8, 0);
+    }
+    return 3;
+}
+
+// What the k-th CPU of the node counted in this tick.
+static uint64_t model_delta(struct xstat_node *node, struct xstat_counter *cnt, int k) {
+    struct perf_counter_context *perf_ctx = node->ctxs[counter_index(cnt)];
+    return perf_ctx ? perf_ctx->events[k].delta : 0;
+}
+
+// Runs after the counters it reads, see node_counters.
+static void model_sample(void **ctx, uint64_t *vals) {
+    struct xstat_node *node = (struct xstat_node *) *ctx;
+    struct xstat_layout *layout = node->layout;
+    struct xstat_model *m = &xstat_models[node->id];
+    int64_t x[XSTAT_MODEL_NX], sum[XSTAT_MODEL_NX], p, e, xx = 0, est = 0;
+    uint64_t intv, energy, y;
+    int ncpus = cpumask_weight(node->mask);
+    int eunit, cpu, i, k = 0;
+    unsigned int khz;
+
+    memset(vals, 0, sizeof(uint64_t) * 3);
+    memset(sum, 0, sizeof(sum));
+    vals[2] = !xstat_rapl;
+    intv = node->vals[layout->first[counter_index(&intv_counter)]];
+    if (!intv)
+        return;
+
+    for_each_cpu(cpu, node->mask) {
+        khz = cpufreq_quick_get(cpu);
+        x[0] = XSTAT_MODEL_BIAS / ncpus;
+        x[1] = div64_u64(model_delta(node, &cyc_counter, k) * 1000, intv);
+        x[2] = div64_u64(model_delta(node, &inst_counter, k) * 1000, intv);
+        x[3] = div64_u64(model_delta(node, &llcmiss_counter, k) * 1000, intv);
+        x[4] = div64_u64(x[1] * (khz ? khz : 1000000), 1000000);
+        p = 0;
+        for (i = 0; i < XSTAT_MODEL_NX; i++) {
+            p += m->w[i] * x[i];
+            sum[i] += x[i];
+        }
+        p = div64_s64(p, 1 << XSTAT_MODEL_SHIFT);
+        est += p;
+        per_cpu(xstat_model_cpupwr, cpu) = max_t(int64_t, p, 0);
+        k++;
+    }
+    vals[0] = max_t(int64_t, est, 0);
+    vals[1] = m->err;
+    // Ticks shorter than half the period, such as one cut short by a
+    // restart, carry too few RAPL updates to fit on.
+    if (!xstat_rapl || node->rec_kind != XSTAT_REC_SAMPLE ||
+            intv < (uint64_t) ctrl_period * 1000000 / 2)
+        return;
+
+    // mW of the node's share of the package.
+    energy = node->vals[layout->first[counter_index(&energy_counter)]];
+    eunit = node->vals[layout->first[counter_index(&eunit_counter)]];
+    y = div64_u64(((energy * 1000) >> eunit) * 1000000000, intv);
+    y = div_u64(y * ncpus, cpumask_weight(topology_core_cpumask(node->cpu)));
+    for (i = 0; i < XSTAT_MODEL_NX; i++)
+        xx += sum[i] * sum[i];
+    if (!y || !xx)
+        return;
+    e = (int64_t) y - est;
+    for (i = 0; i < XSTAT_MODEL_NX; i++)
+        m->w[i] += div64_s64((e * sum[i]) << (XSTAT_MODEL_SHIFT - XSTAT_MODEL_MU), xx);
+    m->err += ((int) min_t(uint64_t, div64_u64(abs64(e) * 1000, y), 1000) - m->err) / 8;
+}
+
+// Weights (Q16) and error of each node, then the mW of each of its CPUs.
+static ssize_t show_model_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        char *buf) {
+    struct xstat_model *m;
+    int limit = PAGE_SIZE;
+    char *ptr = buf;
+    int ret, i, cpu;
+
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        if (!xstat_nodes[i])
+            continue;
+        m = &xstat_models[i];
+        ret = scnprintf(ptr, limit, "node%d %lld %lld %lld %lld %lld %d\n", i,
+                m->w[0], m->w[1], m->w[2], m->w[3], m->w[4], m->err);
+        ptr += ret;
+        limit -= ret;
+        for_each_cpu(cpu, xstat_nodes[i]->mask) {
+            ret = scnprintf(ptr, limit, "cpu%d %u\n", cpu, per_cpu(xstat_model_cpupwr, cpu));
+            ptr += ret;
+            limit -= ret;
+        }
+    }
+    return ptr - buf;
+}
+
+// Five weights, for every node.
+static ssize_t store_model_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        const char *buf,
+        size_t count) {
+    long long w[XSTAT_MODEL_NX];
+    int i, j;
+    if (sscanf(buf, "%lld %lld %lld %lld %lld", &w[0], &w[1], &w[2], &w[3], &w[4]) != 5)
+        return -EINVAL;
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        for (j = 0; j < XSTAT_MODEL_NX; j++)
+            xstat_models[i].w[j] = w[j];
+    }
+    return count;
+}
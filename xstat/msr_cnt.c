@@ -2,7 +2,26 @@
 
 // #define TEMP_DETAIL
 
-static uint64_t temp_restart(void **ctx, uint64_t last) {
+#ifdef TEMP_DETAIL
+#define TEMP_NFIELDS 3
+#else
+#define TEMP_NFIELDS 1
+#endif
+
+static int temp_fields(struct xstat_field *fields, void *data) {
+    if (fields) {
+#ifdef TEMP_DETAIL
+        xstat_field_init(&fields[0], "tjmax", "degC", XSTAT_U8, 0);
+        xstat_field_init(&fields[1], "tmax", "degC", XSTAT_U8, 0);
+        xstat_field_init(&fields[2], "tpkg", "degC", XSTAT_U8, 0);
+#else
+        xstat_field_init(&fields[0], "tpkg", "degC", XSTAT_U8, 0);
+#endif
+    }
+    return TEMP_NFIELDS;
+}
+
+static void temp_sample(void **ctx, uint64_t *vals) {
     uint64_t status, target;
     int tjmax, max, tpkg;
 
@@ -14,23 +33,12 @@ static uint64_t temp_restart(void **ctx, uint64_t last) {
     tpkg = (status >> 16) & 0x7f;
     max = tjmax - max;
     tpkg = tjmax - tpkg;
-    return (tjmax << 24) | (max << 16) | (tpkg);
-}
-
-static int temp_scnprintf(char *buf, int limit, uint64_t data, void **ctx) {
-    int tpkg;
 #ifdef TEMP_DETAIL
-    int tjmax, max;
-    tjmax = (data >> 24) & 0xff;
-    max = (data >> 16) & 0xff;
-#endif
-    tpkg = data & 0xff;
-
-#ifdef TEMP_DETAIL
-    return scnprintf(buf, limit, "\"tjmax\":%d,\"tmax\":%d,\"tpkg\":%d",
-            tjmax, max, tpkg);
+    vals[0] = tjmax;
+    vals[1] = max;
+    vals[2] = tpkg;
 #else
-    return scnprintf(buf, limit, "\"tpkg\":%d", tpkg);
+    vals[0] = tpkg;
 #endif
 }
 
@@ -38,12 +46,14 @@ static int temp_scnprintf(char *buf, int limit, uint64_t data, void **ctx) {
 #undef TEMP_DETAIL
 #endif
 
-static struct xstat_counter temp_counter = __XSTAT_CNT(temp, NULL, NULL, temp_restart, NULL, temp_scnprintf);
+static struct xstat_counter temp_counter = __XSTAT_SMCNT(temp, NULL, NULL, temp_fields, temp_sample, XSTAT_SCOPE_PACKAGE);
 
 static uint64_t energy_restart(void **ctx, uint64_t last) {
     uint64_t laste = (uint64_t) *ctx;
     uint64_t eread;
-    rdmsrl(MSR_PKG_ENERGY_STATUS, eread);
+    // No RAPL, as in most VMs.
+    if (rdmsrl_safe(MSR_PKG_ENERGY_STATUS, &eread))
+        return 0;
     *ctx = (void *) eread;
     eread &= 0xffffffff;
     if (eread < laste) {
@@ -52,15 +62,54 @@ static uint64_t energy_restart(void **ctx, uint64_t last) {
     return eread - laste;
 }
 
-static struct xstat_counter energy_counter = __XSTAT_CNT(energy, NULL, NULL, energy_restart, NULL, NULL);
+static struct xstat_counter energy_counter = __XSTAT_SDCNT(energy, NULL, NULL, energy_restart, NULL, XSTAT_SCOPE_PACKAGE);
 
 static uint64_t eunit_restart(void **ctx, uint64_t last) {
     uint64_t units;
-    rdmsrl(MSR_RAPL_POWER_UNIT, units);
+    if (rdmsrl_safe(MSR_RAPL_POWER_UNIT, &units))
+        return 0;
     return (units >> 8) & 0x1f;
 }
 
-static struct xstat_counter eunit_counter = __XSTAT_CNT(eunit, NULL, NULL, eunit_restart, NULL, NULL);
+// Energy status of the package of cpu and its unit, for readers other than
+// the sampler.
+static int energy_read_cpu(int cpu, uint32_t *energy, int *unit) {
+    uint32_t lo, hi;
+    int ret;
+    ret = rdmsr_safe_on_cpu(cpu, MSR_RAPL_POWER_UNIT, &lo, &hi);
+    CHECK_RET(ret);
+    *unit = (lo >> 8) & 0x1f;
+    return rdmsr_safe_on_cpu(cpu, MSR_PKG_ENERGY_STATUS, energy, &hi);
+}
+
+static struct xstat_counter eunit_counter = __XSTAT_SCNT(eunit, NULL, NULL, eunit_restart, NULL, XSTAT_SCOPE_PACKAGE);
+
+#ifndef MSR_SMI_COUNT
+#define MSR_SMI_COUNT 0x00000034
+#endif
+
+// SMIs since the last record. The 32-bit count is the same on every CPU.
+static int smi_init(const struct cpumask *mask, void *data, void **ctx) {
+    uint64_t count = 0;
+    rdmsrl_safe(MSR_SMI_COUNT, &count);
+    *ctx = (void *) (count & 0xffffffff);
+    return 0;
+}
+
+static uint64_t smi_restart(void **ctx, uint64_t last) {
+    uint64_t lastc = (uint64_t) *ctx;
+    uint64_t count;
+    if (rdmsrl_safe(MSR_SMI_COUNT, &count))
+        return 0;
+    count &= 0xffffffff;
+    *ctx = (void *) count;
+    if (count < lastc) {
+        count += 0x100000000LLU;
+    }
+    return count - lastc;
+}
+
+static struct xstat_counter smi_counter = __XSTAT_SDCNT(smi, smi_init, NULL, smi_restart, NULL, XSTAT_SCOPE_PACKAGE);
 
 #define MSR_CORE_PERF_LIMIT_REASONS_RST_MASK 0xffffffff0000ffffULL
 static uint64_t perflmt_restart(void **ctx, uint64_t last) {
@@ -70,4 +119,4 @@ static uint64_t perflmt_restart(void **ctx, uint64_t last) {
     return perf_limit;
 }
 
-static struct xstat_counter perflmt_counter = __XSTAT_CNT(perflmt, NULL, NULL, perflmt_restart, NULL, NULL);
+static struct xstat_counter perflmt_counter = __XSTAT_SCNT(perflmt, NULL, NULL, perflmt_restart, NULL, XSTAT_SCOPE_PACKAGE);
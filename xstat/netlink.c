@@ -0,0 +1,376 @@
+// To be included in xstat.c after struct xstat_node
+
+#include <linux/netlink.h>
+#include <linux/notifier.h>
+#include <net/genetlink.h>
+
+#include "xstat_netlink.h"
+
+// Records leave as XSTAT_CMD_SAMPLE messages of up to ctrl_watermark records
+// from one node: multicast on the samples group to every listener, and
+// unicast to subscribers that only want some nodes or counters. A filtered
+// record carries the fields of the selected counters in XSTAT_ATTR_FIELDS.
+
+#define XSTAT_NL_MAX_SUBS   8
+#define XSTAT_NL_NBATCH     (1 + XSTAT_NL_MAX_SUBS)
+
+struct xstat_nl_sub {
+    u32 portid;
+    struct net *net;
+    u64 nodes;
+    u64 counters;
+};
+
+// Message being filled by a node sampler; batch 0 is the multicast one.
+struct xstat_nl_batch {
+    struct sk_buff *skb;
+    void *hdr;
+    u32 portid;
+    struct net *net;
+    int n;
+};
+
+static struct genl_family xstat_nl_family = {
+    .id = GENL_ID_GENERATE,
+    .name = XSTAT_GENL_NAME,
+    .version = XSTAT_GENL_VERSION,
+    .maxattr = XSTAT_ATTR_MAX,
+};
+
+static struct genl_multicast_group xstat_nl_mcgrp = {
+    .name = XSTAT_GENL_MCGRP,
+};
+
+static DEFINE_SPINLOCK(xstat_nl_lock);
+static struct xstat_nl_sub xstat_nl_subs[XSTAT_NL_MAX_SUBS];
+static bool xstat_nl_registered;
+
+static int xstat_nl_begin(struct xstat_nl_batch *b, int nid, int size,
+        u32 portid, struct net *net) {
+    b->skb = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+    if (!b->skb)
+        return -ENOMEM;
+    b->hdr = genlmsg_put(b->skb, 0, 0, &xstat_nl_family, 0, XSTAT_CMD_SAMPLE);
+    if (!b->hdr || nla_put_u32(b->skb, XSTAT_ATTR_NODE, nid) ||
+            nla_put_u32(b->skb, XSTAT_ATTR_SIZE, size)) {
+        nlmsg_free(b->skb);
+        b->skb = NULL;
+        return -EMSGSIZE;
+    }
+    b->portid = portid;
+    b->net = net;
+    b->n = 0;
+    return 0;
+}
+
+static void xstat_nl_send(struct xstat_nl_batch *b) {
+    genlmsg_end(b->skb, b->hdr);
+    if (b->portid)
+        genlmsg_unicast(b->net, b->skb, b->portid);
+    else
+        genlmsg_multicast(b->skb, 0, xstat_nl_mcgrp.id, GFP_KERNEL);
+    b->skb = NULL;
+}
+
+static void xstat_nl_drop(struct xstat_nl_batch *b) {
+    if (b->skb) {
+        nlmsg_free(b->skb);
+        b->skb = NULL;
+    }
+}
+
+static int xstat_nl_put(struct sk_buff *skb, struct xstat_layout *layout,
+        const char *rec, u64 counters) {
+    struct xstat_field *field;
+    struct nlattr *nest;
+    int i, j;
+
+    if (!counters)
+        return nla_put(skb, XSTAT_ATTR_RECORD, layout->size, rec);
+
+    nest = nla_nest_start(skb, XSTAT_ATTR_FIELDS);
+    if (!nest)
+        return -EMSGSIZE;
+    for (i = 0; i < XSTAT_NCNT && i < 64; i++) {
+        if (!(counters & (1ULL << i)))
+            continue;
+        for (j = layout->first[i]; j < layout->first[i] + layout->nvals[i]; j++) {
+            field = &layout->fields[j];
+            if (nla_put(skb, j + 1, xstat_type_size[field->type], rec + field->offset)) {
+                nla_nest_cancel(skb, nest);
+                return -EMSGSIZE;
+            }
+        }
+    }
+    nla_nest_end(skb, nest);
+    return 0;
+}
+
+static void xstat_nl_add(struct xstat_nl_batch *b, int nid, struct xstat_layout *layout,
+        const char *rec, struct xstat_nl_sub *sub) {
+    u32 portid = sub ? sub->portid : 0;
+    struct net *net = sub ? sub->net : &init_net;
+    u64 counters = sub ? sub->counters : 0;
+
+    if (!b->skb && xstat_nl_begin(b, nid, layout->size, portid, net) < 0)
+        return;
+    if (xstat_nl_put(b->skb, layout, rec, counters) < 0) {
+        // Full, so this record opens the next message.
+        if (b->n > 0)
+            xstat_nl_send(b);
+        else
+            xstat_nl_drop(b);
+        if (xstat_nl_begin(b, nid, layout->size, portid, net) < 0)
+            return;
+        if (xstat_nl_put(b->skb, layout, rec, counters) < 0) {
+            xstat_nl_drop(b);
+            return;
+        }
+    }
+    if (++b->n >= ctrl_watermark)
+        xstat_nl_send(b);
+}
+
+// Called by the node sampler for every committed record.
+static void xstat_nl_sample(struct xstat_node *node, const char *rec) {
+    struct xstat_nl_sub subs[XSTAT_NL_MAX_SUBS];
+    struct xstat_nl_batch *batches = node->nl;
+    int i;
+
+    if (!xstat_nl_registered || !batches)
+        return;
+    spin_lock_bh(&xstat_nl_lock);
+    memcpy(subs, xstat_nl_subs, sizeof(subs));
+    spin_unlock_bh(&xstat_nl_lock);
+
+    if (netlink_has_listeners(init_net.genl_sock, xstat_nl_mcgrp.id))
+        xstat_nl_add(&batches[0], node->id, node->layout, rec, NULL);
+    else
+        xstat_nl_drop(&batches[0]);
+
+    for (i = 0; i < XSTAT_NL_MAX_SUBS; i++) {
+        if (batches[1 + i].portid != subs[i].portid)
+            xstat_nl_drop(&batches[1 + i]);
+        if (!subs[i].portid || node->id >= 64 || !(subs[i].nodes & (1ULL << node->id)))
+            continue;
+        xstat_nl_add(&batches[1 + i], node->id, node->layout, rec, &subs[i]);
+    }
+}
+
+// Sends what is left once the sampler of the node has stopped.
+static void xstat_nl_flush(struct xstat_node *node) {
+    int i;
+    if (!node->nl)
+        return;
+    for (i = 0; i < XSTAT_NL_NBATCH; i++) {
+        if (node->nl[i].skb && xstat_nl_registered)
+            xstat_nl_send(&node->nl[i]);
+        else
+            xstat_nl_drop(&node->nl[i]);
+    }
+}
+
+static int xstat_nl_start(struct sk_buff *skb, struct genl_info *info) {
+    return start_stat();
+}
+
+static int xstat_nl_stop(struct sk_buff *skb, struct genl_info *info) {
+    stop_stat();
+    return 0;
+}
+
+static int xstat_nl_put_counters(struct sk_buff *skb) {
+    struct nlattr *nest;
+    int i;
+    nest = nla_nest_start(skb, XSTAT_ATTR_COUNTERS);
+    if (!nest)
+        return -EMSGSIZE;
+    for (i = 0; i < XSTAT_NCNT; i++) {
+        if (nla_put_string(skb, i + 1, node_counters[i]->name))
+            return -EMSGSIZE;
+    }
+    nla_nest_end(skb, nest);
+    return 0;
+}
+
+static int xstat_nl_get_config(struct sk_buff *skb, struct genl_info *info) {
+    struct sk_buff *msg;
+    void *hdr;
+    char *schema;
+    int ret = -EMSGSIZE;
+
+    schema = (char *) __get_free_page(GFP_KERNEL);
+    if (!schema)
+        return -ENOMEM;
+    ret = print_session_schema(schema, PAGE_SIZE);
+    if (ret < 0)
+        goto out;
+    ret = -EMSGSIZE;
+
+    msg = genlmsg_new(NLMSG_GOODSIZE, GFP_KERNEL);
+    if (!msg) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    hdr = genlmsg_put(msg, info->snd_portid, info->snd_seq, &xstat_nl_family, 0,
+            XSTAT_CMD_GET_CONFIG);
+    if (!hdr)
+        goto err;
+    if (nla_put_u8(msg, XSTAT_ATTR_ON, ctrl_on) ||
+            nla_put_u32(msg, XSTAT_ATTR_PERIOD, ctrl_period) ||
+            nla_put_u32(msg, XSTAT_ATTR_WATERMARK, ctrl_watermark) ||
+            nla_put_string(msg, XSTAT_ATTR_SCHEMA, schema) ||
+            xstat_nl_put_counters(msg))
+        goto err;
+    genlmsg_end(msg, hdr);
+    ret = genlmsg_reply(msg, info);
+    goto out;
+
+err:
+    nlmsg_free(msg);
+out:
+    free_page((unsigned long) schema);
+    return ret;
+}
+
+static int xstat_nl_set_config(struct sk_buff *skb, struct genl_info *info) {
+    u32 period = ctrl_period;
+    u32 watermark = ctrl_watermark;
+
+    if (info->attrs[XSTAT_ATTR_PERIOD])
+        period = nla_get_u32(info->attrs[XSTAT_ATTR_PERIOD]);
+    if (info->attrs[XSTAT_ATTR_WATERMARK])
+        watermark = nla_get_u32(info->attrs[XSTAT_ATTR_WATERMARK]);
+    if (period == 0 || period >= 10000 || watermark == 0 || watermark > XSTAT_NBUF)
+        return -EINVAL;
+
+    mutex_lock(&ctrl_lock);
+    ctrl_period = period;
+    ctrl_watermark = watermark;
+    mutex_unlock(&ctrl_lock);
+    return 0;
+}
+
+static int xstat_nl_subscribe(struct sk_buff *skb, struct genl_info *info) {
+    struct xstat_nl_sub *sub = NULL;
+    u64 nodes = ~0ULL;
+    u64 counters = 0;
+    int i;
+
+    if (info->attrs[XSTAT_ATTR_NODE_MASK])
+        nodes = nla_get_u64(info->attrs[XSTAT_ATTR_NODE_MASK]);
+    if (info->attrs[XSTAT_ATTR_CNT_MASK])
+        counters = nla_get_u64(info->attrs[XSTAT_ATTR_CNT_MASK]);
+
+    spin_lock_bh(&xstat_nl_lock);
+    for (i = 0; i < XSTAT_NL_MAX_SUBS; i++) {
+        if (xstat_nl_subs[i].portid == info->snd_portid &&
+                xstat_nl_subs[i].net == genl_info_net(info)) {
+            sub = &xstat_nl_subs[i];
+            break;
+        }
+        if (!sub && !xstat_nl_subs[i].portid)
+            sub = &xstat_nl_subs[i];
+    }
+    if (sub) {
+        sub->portid = info->snd_portid;
+        sub->net = genl_info_net(info);
+        sub->nodes = nodes;
+        sub->counters = counters;
+    }
+    spin_unlock_bh(&xstat_nl_lock);
+    return sub ? 0 : -ENOSPC;
+}
+
+static void xstat_nl_unsubscribe_port(struct net *net, u32 portid) {
+    int i;
+    spin_lock_bh(&xstat_nl_lock);
+    for (i = 0; i < XSTAT_NL_MAX_SUBS; i++) {
+        if (xstat_nl_subs[i].portid == portid && xstat_nl_subs[i].net == net)
+            memset(&xstat_nl_subs[i], 0, sizeof(struct xstat_nl_sub));
+    }
+    spin_unlock_bh(&xstat_nl_lock);
+}
+
+static int xstat_nl_unsubscribe(struct sk_buff *skb, struct genl_info *info) {
+    xstat_nl_unsubscribe_port(genl_info_net(info), info->snd_portid);
+    return 0;
+}
+
+// Subscribers go away with their socket.
+static int xstat_nl_notify(struct notifier_block *nb, unsigned long state, void *_notify) {
+    struct netlink_notify *notify = _notify;
+    if (state == NETLINK_URELEASE && notify->protocol == NETLINK_GENERIC)
+        xstat_nl_unsubscribe_port(notify->net, notify->portid);
+    return NOTIFY_DONE;
+}
+
+static struct notifier_block xstat_nl_notifier = {
+    .notifier_call = xstat_nl_notify,
+};
+
+static const struct nla_policy xstat_nl_policy[XSTAT_ATTR_MAX + 1] = {
+    [XSTAT_ATTR_PERIOD] = { .type = NLA_U32 },
+    [XSTAT_ATTR_WATERMARK] = { .type = NLA_U32 },
+    [XSTAT_ATTR_NODE_MASK] = { .type = NLA_U64 },
+    [XSTAT_ATTR_CNT_MASK] = { .type = NLA_U64 },
+};
+
+static struct genl_ops xstat_nl_ops[] = {
+    {
+        .cmd = XSTAT_CMD_START,
+        .flags = GENL_ADMIN_PERM,
+        .policy = xstat_nl_policy,
+        .doit = xstat_nl_start,
+    },
+    {
+        .cmd = XSTAT_CMD_STOP,
+        .flags = GENL_ADMIN_PERM,
+        .policy = xstat_nl_policy,
+        .doit = xstat_nl_stop,
+    },
+    {
+        .cmd = XSTAT_CMD_GET_CONFIG,
+        .policy = xstat_nl_policy,
+        .doit = xstat_nl_get_config,
+    },
+    {
+        .cmd = XSTAT_CMD_SET_CONFIG,
+        .flags = GENL_ADMIN_PERM,
+        .policy = xstat_nl_policy,
+        .doit = xstat_nl_set_config,
+    },
+    {
+        .cmd = XSTAT_CMD_SUBSCRIBE,
+        .policy = xstat_nl_policy,
+        .doit = xstat_nl_subscribe,
+    },
+    {
+        .cmd = XSTAT_CMD_UNSUBSCRIBE,
+        .policy = xstat_nl_policy,
+        .doit = xstat_nl_unsubscribe,
+    },
+};
+
+static int xstat_nl_init(void) {
+    int ret;
+    ret = genl_register_family_with_ops(&xstat_nl_family, xstat_nl_ops,
+            ARRAY_SIZE(xstat_nl_ops));
+    CHECK_RET(ret);
+    ret = genl_register_mc_group(&xstat_nl_family, &xstat_nl_mcgrp);
+    if (ret < 0) {
+        genl_unregister_family(&xstat_nl_family);
+        return ret;
+    }
+    netlink_register_notifier(&xstat_nl_notifier);
+    xstat_nl_registered = true;
+    return 0;
+}
+
+static void xstat_nl_exit(void) {
+    if (xstat_nl_registered) {
+        xstat_nl_registered = false;
+        netlink_unregister_notifier(&xstat_nl_notifier);
+        genl_unregister_family(&xstat_nl_family);
+    }
+}
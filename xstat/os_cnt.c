@@ -0,0 +1,111 @@
+// To be included in xstat.c
+
+#include <linux/kernel_stat.h>
+#include <linux/sched.h>
+
+// What the OS did on the node's CPUs: context switches, and time in hard and
+// soft IRQs, iowait, idle and busy (user, system and IRQs), all summed over
+// the node. Times come from the kernel's
+// per-CPU cpustat, with idle and iowait from the NO_HZ accounting where it
+// is kept as /proc/stat does. Context switches are the scheduler's per-CPU
+// count, read through a software perf event. Run queue lengths are left out:
+// the kernel exports no per-CPU count of runnable tasks to modules.
+
+static struct perf_event_config perf_ctxsw_data = {
+    .type = PERF_TYPE_SOFTWARE,
+    .config = PERF_COUNT_SW_CONTEXT_SWITCHES,
+};
+
+enum {
+    XSTAT_OS_IRQ,
+    XSTAT_OS_SOFTIRQ,
+    XSTAT_OS_IOWAIT,
+    XSTAT_OS_IDLE,
+    XSTAT_OS_BUSY,
+    XSTAT_OS_NTIME,
+};
+
+struct xstat_os {
+    const struct cpumask *mask;
+    void *perf;
+    // Node totals in us at the last record.
+    uint64_t last[XSTAT_OS_NTIME];
+};
+
+static uint64_t os_usecs(int cpu, int idx) {
+    return cputime_to_usecs((cputime_t) kcpustat_cpu(cpu).cpustat[idx]);
+}
+
+static void os_times(const struct cpumask *mask, uint64_t *times) {
+    uint64_t us;
+    int cpu;
+    memset(times, 0, sizeof(uint64_t) * XSTAT_OS_NTIME);
+    for_each_cpu(cpu, mask) {
+        times[XSTAT_OS_IRQ] += os_usecs(cpu, CPUTIME_IRQ);
+        times[XSTAT_OS_SOFTIRQ] += os_usecs(cpu, CPUTIME_SOFTIRQ);
+        us = get_cpu_iowait_time_us(cpu, NULL);
+        times[XSTAT_OS_IOWAIT] += us != -1ULL ? us : os_usecs(cpu, CPUTIME_IOWAIT);
+        us = get_cpu_idle_time_us(cpu, NULL);
+        times[XSTAT_OS_IDLE] += us != -1ULL ? us : os_usecs(cpu, CPUTIME_IDLE);
+        times[XSTAT_OS_BUSY] += os_usecs(cpu, CPUTIME_USER) + os_usecs(cpu, CPUTIME_NICE) +
+            os_usecs(cpu, CPUTIME_SYSTEM) + os_usecs(cpu, CPUTIME_IRQ) +
+            os_usecs(cpu, CPUTIME_SOFTIRQ);
+    }
+}
+
+static int os_init(const struct cpumask *mask, void *data, void **ctx) {
+    struct xstat_os *os = kzalloc(sizeof(struct xstat_os), GFP_KERNEL);
+    *ctx = os;
+    if (!os)
+        return -ENOMEM;
+    os->mask = mask;
+    perf_init(mask, &perf_ctxsw_data, &os->perf);
+    os_times(mask, os->last);
+    return 0;
+}
+
+static void os_exit(void **ctx) {
+    struct xstat_os *os = (struct xstat_os *) *ctx;
+    if (os) {
+        if (os->perf)
+            perf_exit(&os->perf);
+        kfree(os);
+    }
+}
+
+static int os_fields(struct xstat_field *fields, void *data) {
+    int i;
+    if (fields) {
+        xstat_field_init(&fields[0], "ctxsw", "", XSTAT_U32, 0);
+        xstat_field_init(&fields[1], "irq", "us", XSTAT_U32, 0);
+        xstat_field_init(&fields[2], "softirq", "us", XSTAT_U32, 0);
+        xstat_field_init(&fields[3], "iowait", "us", XSTAT_U32, 0);
+        xstat_field_init(&fields[4], "idle", "us", XSTAT_U32, 0);
+        xstat_field_init(&fields[5], "busy", "us", XSTAT_U32, 0);
+        for (i = 0; i <= XSTAT_OS_NTIME; i++)
+            fields[i].flags = XSTAT_FIELD_DELTA;
+    }
+    return 1 + XSTAT_OS_NTIME;
+}
+
+static void os_sample(void **ctx, uint64_t *vals) {
+    struct xstat_os *os = (struct xstat_os *) *ctx;
+    uint64_t times[XSTAT_OS_NTIME];
+    int i;
+    if (!os) {
+        memset(vals, 0, sizeof(uint64_t) * (1 + XSTAT_OS_NTIME));
+        return;
+    }
+    vals[0] = os->perf ? perf_restart(&os->perf, 0) : 0;
+    os_times(os->mask, times);
+    for (i = 0; i < XSTAT_OS_NTIME; i++) {
+        // The NO_HZ idle times can step back a little across a wakeup.
+        vals[1 + i] = 0;
+        if (times[i] > os->last[i]) {
+            vals[1 + i] = times[i] - os->last[i];
+            os->last[i] = times[i];
+        }
+    }
+}
+
+static struct xstat_counter os_counter = __XSTAT_MCNT(os, os_init, os_exit, os_fields, os_sample);
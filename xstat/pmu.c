@@ -0,0 +1,353 @@
+// To be included in xstat.c after struct xstat_node
+
+#include <linux/ctype.h>
+#include <linux/perf_event.h>
+#include <linux/seqlock.h>
+
+// The "xstat" perf PMU, so perf stat -e xstat/<field>/ reads what the
+// samplers record. It is registered at module load, and each field of a
+// layout built then becomes an event with config set to its index in
+// xstat_pmu_events; energy is energy_pkg and IPMI fields get an ipmi_ prefix.
+// Fields only known later, from the SDR scan or the DCMI probe, have no event.
+// Events belong to a node: they open on any of its CPUs, the cpumask attr
+// naming the sampler CPU of each. Delta fields count up
+// record by record, the others read the latest value. energy_pkg counts uJ,
+// converted from RAPL units with the eunit of each record.
+
+struct xstat_pmu_event {
+    char name[XSTAT_FIELD_LEN + 8];
+    char scale_name[XSTAT_FIELD_LEN + 16];
+    char unit_name[XSTAT_FIELD_LEN + 16];
+    char field_name[XSTAT_FIELD_LEN];
+    char unit[XSTAT_UNIT_LEN];
+    int8_t scale;
+    bool delta;
+    bool energy;
+    // Index in the session layout, -1 if the session has no such field.
+    int field;
+    struct device_attribute attr;
+    struct device_attribute scale_attr;
+    struct device_attribute unit_attr;
+};
+
+static struct xstat_pmu_event *xstat_pmu_events;
+static int xstat_pmu_nevents;
+static struct attribute **xstat_pmu_event_attrs;
+static bool xstat_pmu_registered;
+
+static const char *xstat_pmu_aliases[][2] = {
+    { "energy", "energy_pkg" },
+};
+
+// Called by the node sampler with the values of each record it takes.
+static void xstat_pmu_update(struct xstat_node *node, const uint64_t *vals) {
+    struct xstat_pmu_event *ev;
+    unsigned long flags;
+    uint64_t val;
+    int eunit;
+    int i;
+    if (!node->pmu_vals)
+        return;
+    eunit = vals[node->layout->first[counter_index(&eunit_counter)]];
+    write_seqlock_irqsave(&node->pmu_lock, flags);
+    for (i = 0; i < xstat_pmu_nevents; i++) {
+        ev = &xstat_pmu_events[i];
+        if (ev->field < 0)
+            continue;
+        val = vals[ev->field];
+        if (ev->energy)
+            val = (val * 1000000) >> eunit;
+        if (ev->delta)
+            node->pmu_vals[i] += val;
+        else
+            node->pmu_vals[i] = val;
+    }
+    write_sequnlock_irqrestore(&node->pmu_lock, flags);
+}
+
+static uint64_t xstat_pmu_value(struct perf_event *event) {
+    struct xstat_node *node = xstat_nodes[cpu_to_node(event->cpu)];
+    unsigned int seq;
+    uint64_t val;
+    do {
+        seq = read_seqbegin(&node->pmu_lock);
+        val = node->pmu_vals[event->hw.config];
+    } while (read_seqretry(&node->pmu_lock, seq));
+    return val;
+}
+
+static struct pmu xstat_pmu;
+
+static int xstat_pmu_event_init(struct perf_event *event) {
+    struct xstat_node *node;
+    if (event->attr.type != xstat_pmu.type)
+        return -ENOENT;
+    if (event->attr.config >= xstat_pmu_nevents)
+        return -EINVAL;
+    // Node values: nothing to sample and no task to follow.
+    if (event->cpu < 0 || is_sampling_event(event))
+        return -EINVAL;
+    node = xstat_nodes[cpu_to_node(event->cpu)];
+    if (!node || !node->pmu_vals)
+        return -ENODEV;
+    event->hw.config = event->attr.config;
+    return 0;
+}
+
+static void xstat_pmu_event_read(struct perf_event *event) {
+    uint64_t now = xstat_pmu_value(event);
+    uint64_t prev;
+    if (xstat_pmu_events[event->hw.config].delta) {
+        prev = local64_xchg(&event->hw.prev_count, now);
+        local64_add(now - prev, &event->count);
+    } else {
+        local64_set(&event->count, now);
+    }
+}
+
+static void xstat_pmu_event_start(struct perf_event *event, int flags) {
+    local64_set(&event->hw.prev_count, xstat_pmu_value(event));
+    event->hw.state = 0;
+}
+
+static void xstat_pmu_event_stop(struct perf_event *event, int flags) {
+    if (!(event->hw.state & PERF_HES_STOPPED)) {
+        xstat_pmu_event_read(event);
+        event->hw.state |= PERF_HES_STOPPED | PERF_HES_UPTODATE;
+    }
+}
+
+static int xstat_pmu_event_add(struct perf_event *event, int flags) {
+    event->hw.state = PERF_HES_STOPPED | PERF_HES_UPTODATE;
+    if (flags & PERF_EF_START)
+        xstat_pmu_event_start(event, flags);
+    return 0;
+}
+
+static void xstat_pmu_event_del(struct perf_event *event, int flags) {
+    xstat_pmu_event_stop(event, PERF_EF_UPDATE);
+}
+
+static ssize_t xstat_pmu_event_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    struct xstat_pmu_event *ev = container_of(attr, struct xstat_pmu_event, attr);
+    return sprintf(buf, "config=0x%x\n", (int) (ev - xstat_pmu_events));
+}
+
+static ssize_t xstat_pmu_scale_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    struct xstat_pmu_event *ev = container_of(attr, struct xstat_pmu_event, scale_attr);
+    return sprintf(buf, "1e%d\n", ev->scale);
+}
+
+static ssize_t xstat_pmu_unit_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    struct xstat_pmu_event *ev = container_of(attr, struct xstat_pmu_event, unit_attr);
+    return sprintf(buf, "%s\n", ev->unit);
+}
+
+// The sampler CPU of each node.
+static ssize_t xstat_pmu_cpumask_show(struct device *dev,
+        struct device_attribute *attr, char *buf) {
+    int i, n = 0;
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        if (xstat_nodes[i])
+            n += sprintf(buf + n, "%s%d", n ? "," : "", xstat_nodes[i]->cpu);
+    }
+    return n + sprintf(buf + n, "\n");
+}
+
+static DEVICE_ATTR(cpumask, S_IRUGO, xstat_pmu_cpumask_show, NULL);
+PMU_FORMAT_ATTR(config, "config:0-15");
+
+static struct attribute *xstat_pmu_format_attrs[] = {
+    &format_attr_config.attr,
+    NULL,
+};
+
+static struct attribute *xstat_pmu_cpumask_attrs[] = {
+    &dev_attr_cpumask.attr,
+    NULL,
+};
+
+static struct attribute_group xstat_pmu_format_group = {
+    .name = "format",
+    .attrs = xstat_pmu_format_attrs,
+};
+
+static struct attribute_group xstat_pmu_events_group = {
+    .name = "events",
+};
+
+static struct attribute_group xstat_pmu_cpumask_group = {
+    .attrs = xstat_pmu_cpumask_attrs,
+};
+
+static const struct attribute_group *xstat_pmu_attr_groups[] = {
+    &xstat_pmu_format_group,
+    &xstat_pmu_events_group,
+    &xstat_pmu_cpumask_group,
+    NULL,
+};
+
+static struct pmu xstat_pmu = {
+    .task_ctx_nr = perf_invalid_context,
+    .attr_groups = xstat_pmu_attr_groups,
+    .event_init = xstat_pmu_event_init,
+    .add = xstat_pmu_event_add,
+    .del = xstat_pmu_event_del,
+    .start = xstat_pmu_event_start,
+    .stop = xstat_pmu_event_stop,
+    .read = xstat_pmu_event_read,
+};
+
+// Lower case, anything but letters and digits made '_'.
+static void xstat_pmu_name(char *name, int len, const char *field, bool ipmi) {
+    char *p;
+    int i;
+    for (i = 0; i < ARRAY_SIZE(xstat_pmu_aliases); i++) {
+        if (strcmp(field, xstat_pmu_aliases[i][0]) == 0) {
+            field = xstat_pmu_aliases[i][1];
+            break;
+        }
+    }
+    snprintf(name, len, "%s%s", ipmi && strncmp(field, "ipmi", 4) ? "ipmi_" : "", field);
+    for (p = name; *p; p++) {
+        *p = tolower(*p);
+        if (!isalnum(*p))
+            *p = '_';
+    }
+}
+
+static void xstat_pmu_attr(struct device_attribute *attr, const char *name,
+        ssize_t (*show)(struct device *, struct device_attribute *, char *)) {
+    sysfs_attr_init(&attr->attr);
+    attr->attr.name = name;
+    attr->attr.mode = S_IRUGO;
+    attr->show = show;
+}
+
+static void xstat_pmu_free(void) {
+    int i;
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        if (xstat_nodes[i]) {
+            kfree(xstat_nodes[i]->pmu_vals);
+            xstat_nodes[i]->pmu_vals = NULL;
+        }
+    }
+    kfree(xstat_pmu_event_attrs);
+    kfree(xstat_pmu_events);
+    xstat_pmu_event_attrs = NULL;
+    xstat_pmu_events = NULL;
+    xstat_pmu_nevents = 0;
+}
+
+// One event per field of layout, skipping names already taken.
+static int xstat_pmu_build(struct xstat_layout *layout) {
+    struct xstat_pmu_event *ev;
+    struct xstat_field *field;
+    bool ipmi;
+    int i, j, k, n = 0, a = 0;
+
+    xstat_pmu_events = kcalloc(layout->nfields ? layout->nfields : 1,
+            sizeof(struct xstat_pmu_event), GFP_KERNEL);
+    xstat_pmu_event_attrs = kcalloc(3 * layout->nfields + 1,
+            sizeof(struct attribute *), GFP_KERNEL);
+    if (!xstat_pmu_events || !xstat_pmu_event_attrs)
+        return -ENOMEM;
+
+    for (i = 0; i < XSTAT_NCNT; i++) {
+        ipmi = false;
+#ifdef XSTAT_IPMI
+        ipmi = xstat_ipmi_counter(node_counters[i]);
+#endif
+        for (j = layout->first[i]; j < layout->first[i] + layout->nvals[i]; j++) {
+            field = &layout->fields[j];
+            ev = &xstat_pmu_events[n];
+            xstat_pmu_name(ev->name, sizeof(ev->name), field->name, ipmi);
+            for (k = 0; k < n && strcmp(xstat_pmu_events[k].name, ev->name); k++)
+                ;
+            if (k < n)
+                continue;
+            strlcpy(ev->field_name, field->name, XSTAT_FIELD_LEN);
+            strlcpy(ev->unit, field->unit, XSTAT_UNIT_LEN);
+            ev->scale = field->scale;
+            ev->delta = field->flags & XSTAT_FIELD_DELTA;
+            if (node_counters[i] == &energy_counter) {
+                strlcpy(ev->unit, "Joules", XSTAT_UNIT_LEN);
+                ev->scale = -6;
+                ev->energy = true;
+            }
+            ev->field = j;
+            xstat_pmu_attr(&ev->attr, ev->name, xstat_pmu_event_show);
+            xstat_pmu_event_attrs[a++] = &ev->attr.attr;
+            if (ev->scale) {
+                snprintf(ev->scale_name, sizeof(ev->scale_name), "%s.scale", ev->name);
+                xstat_pmu_attr(&ev->scale_attr, ev->scale_name, xstat_pmu_scale_show);
+                xstat_pmu_event_attrs[a++] = &ev->scale_attr.attr;
+            }
+            if (ev->unit[0]) {
+                snprintf(ev->unit_name, sizeof(ev->unit_name), "%s.unit", ev->name);
+                xstat_pmu_attr(&ev->unit_attr, ev->unit_name, xstat_pmu_unit_show);
+                xstat_pmu_event_attrs[a++] = &ev->unit_attr.attr;
+            }
+            n++;
+        }
+    }
+    xstat_pmu_nevents = n;
+    xstat_pmu_events_group.attrs = xstat_pmu_event_attrs;
+
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        if (!xstat_nodes[i])
+            continue;
+        xstat_nodes[i]->pmu_vals = kcalloc(n ? n : 1, sizeof(uint64_t), GFP_KERNEL);
+        if (!xstat_nodes[i]->pmu_vals)
+            return -ENOMEM;
+    }
+    return 0;
+}
+
+// After the nodes are registered. Events read nothing until a session starts.
+static void xstat_pmu_init(void) {
+    struct xstat_layout *layout;
+    int i;
+
+    layout = build_layout(node_counters, XSTAT_NCNT);
+    if (!layout || xstat_pmu_build(layout) < 0 ||
+            perf_pmu_register(&xstat_pmu, "xstat", -1) < 0) {
+        printk(KERN_WARNING "xstat: perf PMU not registered.\n");
+        xstat_pmu_free();
+        put_layout(layout);
+        return;
+    }
+    put_layout(layout);
+    for (i = 0; i < xstat_pmu_nevents; i++)
+        xstat_pmu_events[i].field = -1;
+    xstat_pmu_registered = true;
+}
+
+// Points the events at the fields of a new session. Sampling is off.
+static void xstat_pmu_session(struct xstat_layout *layout) {
+    struct xstat_pmu_event *ev;
+    int i, j;
+
+    for (i = 0; i < xstat_pmu_nevents; i++) {
+        ev = &xstat_pmu_events[i];
+        ev->field = -1;
+        for (j = 0; j < layout->nfields; j++) {
+            if (strcmp(layout->fields[j].name, ev->field_name) == 0) {
+                ev->field = j;
+                break;
+            }
+        }
+    }
+}
+
+// After the samplers have stopped.
+static void xstat_pmu_exit(void) {
+    if (xstat_pmu_registered) {
+        perf_pmu_unregister(&xstat_pmu);
+        xstat_pmu_registered = false;
+    }
+    xstat_pmu_free();
+}
@@ -0,0 +1,372 @@
+// To be included in xstat.c
+
+#include <linux/kref.h>
+#include <linux/math64.h>
+
+// Session record layout. Every counter contributes its fields in
+// node_counters order, a plain restart counter one XSTAT_U64 named after it.
+// Fields sit at their natural alignment and the record is padded to 8 bytes,
+// so records are fixed width for a session and described by the schema attr.
+
+// Held by the nodes sampling with it and by readers still formatting its
+// records.
+struct xstat_key {
+    const char *str;
+    int len;
+};
+
+// keys and header are the text around the values, made once per session.
+struct xstat_layout {
+    struct kref ref;
+    int nfields;
+    int size;
+    struct xstat_field *fields;
+    int *first;
+    int *nvals;
+    struct xstat_key *keys;
+    char *keybuf;
+    char *header;
+    int header_len;
+    // Longest text of a record in either format, and of the header.
+    int text_len;
+};
+
+enum xstat_format {
+    XSTAT_FMT_JSON,
+    XSTAT_FMT_CSV,
+};
+
+static const uint8_t xstat_type_size[] = {
+    [XSTAT_U64] = 8,
+    [XSTAT_S64] = 8,
+    [XSTAT_U32] = 4,
+    [XSTAT_S32] = 4,
+    [XSTAT_U16] = 2,
+    [XSTAT_S16] = 2,
+    [XSTAT_U8] = 1,
+};
+
+static const char *xstat_type_name[] = {
+    [XSTAT_U64] = "u64",
+    [XSTAT_S64] = "s64",
+    [XSTAT_U32] = "u32",
+    [XSTAT_S32] = "s32",
+    [XSTAT_U16] = "u16",
+    [XSTAT_S16] = "s16",
+    [XSTAT_U8] = "u8",
+};
+
+static bool xstat_type_signed(uint8_t type) {
+    return type == XSTAT_S64 || type == XSTAT_S32 || type == XSTAT_S16;
+}
+
+static int xstat_counter_nfields(struct xstat_counter *cnt) {
+    if (cnt->fields)
+        return cnt->fields(NULL, cnt->data);
+    return 1;
+}
+
+static void free_layout(struct xstat_layout *layout) {
+    if (layout) {
+        kfree(layout->header);
+        kfree(layout->keybuf);
+        kfree(layout->keys);
+        kfree(layout->fields);
+        kfree(layout->first);
+        kfree(layout->nvals);
+        kfree(layout);
+    }
+}
+
+static void release_layout(struct kref *ref) {
+    free_layout(container_of(ref, struct xstat_layout, ref));
+}
+
+static void get_layout(struct xstat_layout *layout) {
+    kref_get(&layout->ref);
+}
+
+static void put_layout(struct xstat_layout *layout) {
+    if (layout)
+        kref_put(&layout->ref, release_layout);
+}
+
+#define XSTAT_MAX_SCALE 18
+
+// Decimal digits of the largest magnitude of each type.
+static const uint8_t xstat_type_digits[] = {
+    [XSTAT_U64] = 20,
+    [XSTAT_S64] = 19,
+    [XSTAT_U32] = 10,
+    [XSTAT_S32] = 10,
+    [XSTAT_U16] = 5,
+    [XSTAT_S16] = 5,
+    [XSTAT_U8] = 3,
+};
+
+// Longest value put_value writes for field: sign, digits, and the point and
+// decimals of a negative scale.
+static int xstat_value_len(struct xstat_field *field) {
+    int scale = clamp_t(int, field->scale, -XSTAT_MAX_SCALE, XSTAT_MAX_SCALE);
+    int len = xstat_type_digits[field->type];
+    if (scale > 0)
+        len = min(len + scale, 20);
+    else if (scale < 0)
+        len += 1 - scale;
+    return len + xstat_type_signed(field->type);
+}
+
+// ,"name": for JSON, skipping the comma for the first field, and the CSV
+// header line.
+static int build_keys(struct xstat_layout *layout) {
+    char *kp, *hp;
+    int i, len = 0, vlen = 0;
+
+    for (i = 0; i < layout->nfields; i++) {
+        len += strlen(layout->fields[i].name) + 4;
+        vlen += xstat_value_len(&layout->fields[i]);
+    }
+    layout->keys = kcalloc(layout->nfields ? layout->nfields : 1,
+            sizeof(struct xstat_key), GFP_KERNEL);
+    layout->keybuf = kmalloc(len + 1, GFP_KERNEL);
+    layout->header = kmalloc(len + 1, GFP_KERNEL);
+    if (!layout->keys || !layout->keybuf || !layout->header)
+        return -ENOMEM;
+
+    kp = layout->keybuf;
+    hp = layout->header;
+    for (i = 0; i < layout->nfields; i++) {
+        layout->keys[i].str = kp;
+        kp += sprintf(kp, "%s\"%s\":", i == 0 ? "" : ",", layout->fields[i].name);
+        layout->keys[i].len = kp - layout->keys[i].str;
+        hp += sprintf(hp, "%s%s", i == 0 ? "" : ",", layout->fields[i].name);
+    }
+    *hp++ = '\n';
+    layout->header_len = hp - layout->header;
+    // Braces, newline and NUL around the keys and values.
+    layout->text_len = max(len + vlen + 4, layout->header_len + 1);
+    return 0;
+}
+
+static struct xstat_layout *build_layout(struct xstat_counter **cnts, int ncnt) {
+    struct xstat_layout *layout;
+    struct xstat_field *field;
+    int i, j, n = 0, size = 0, fsize;
+
+    layout = kzalloc(sizeof(struct xstat_layout), GFP_KERNEL);
+    if (!layout)
+        return NULL;
+    kref_init(&layout->ref);
+    layout->first = kcalloc(ncnt, sizeof(int), GFP_KERNEL);
+    layout->nvals = kcalloc(ncnt, sizeof(int), GFP_KERNEL);
+    if (!layout->first || !layout->nvals)
+        goto err;
+
+    for (i = 0; i < ncnt; i++) {
+        layout->first[i] = n;
+        layout->nvals[i] = xstat_counter_nfields(cnts[i]);
+        n += layout->nvals[i];
+    }
+    layout->nfields = n;
+    layout->fields = kcalloc(n ? n : 1, sizeof(struct xstat_field), GFP_KERNEL);
+    if (!layout->fields)
+        goto err;
+
+    for (i = 0; i < ncnt; i++) {
+        field = &layout->fields[layout->first[i]];
+        if (cnts[i]->fields) {
+            cnts[i]->fields(field, cnts[i]->data);
+        } else {
+            xstat_field_init(field, cnts[i]->name, "", XSTAT_U64, 0);
+            field->flags = cnts[i]->flags;
+        }
+        for (j = 0; j < layout->nvals[i]; j++, field++) {
+            fsize = xstat_type_size[field->type];
+            size = ALIGN(size, fsize);
+            field->offset = size;
+            size += fsize;
+        }
+    }
+    layout->size = ALIGN(size, 8);
+    if (build_keys(layout) < 0)
+        goto err;
+    return layout;
+
+err:
+    free_layout(layout);
+    return NULL;
+}
+
+static void record_set(struct xstat_field *field, char *rec, uint64_t val) {
+    switch (field->type) {
+    case XSTAT_U64:
+    case XSTAT_S64:
+        *(uint64_t *) (rec + field->offset) = val;
+        break;
+    case XSTAT_U32:
+    case XSTAT_S32:
+        *(uint32_t *) (rec + field->offset) = val;
+        break;
+    case XSTAT_U16:
+    case XSTAT_S16:
+        *(uint16_t *) (rec + field->offset) = val;
+        break;
+    case XSTAT_U8:
+        *(uint8_t *) (rec + field->offset) = val;
+        break;
+    }
+}
+
+static void pack_record(struct xstat_layout *layout, char *rec, uint64_t *vals) {
+    int i;
+    for (i = 0; i < layout->nfields; i++)
+        record_set(&layout->fields[i], rec, vals[i]);
+}
+
+// Value of a field, sign extended for the signed types.
+static int64_t record_value(struct xstat_field *field, const char *rec) {
+    const char *ptr = rec + field->offset;
+    switch (field->type) {
+    case XSTAT_S64: return *(int64_t *) ptr;
+    case XSTAT_U32: return *(uint32_t *) ptr;
+    case XSTAT_S32: return *(int32_t *) ptr;
+    case XSTAT_U16: return *(uint16_t *) ptr;
+    case XSTAT_S16: return *(int16_t *) ptr;
+    case XSTAT_U8: return *(uint8_t *) ptr;
+    default: return *(uint64_t *) ptr;
+    }
+}
+
+// ts is the first counter, see node_counters.
+static uint64_t record_ts(struct xstat_layout *layout, const char *rec) {
+    return *(const uint64_t *) (rec + layout->fields[0].offset);
+}
+
+static const char xstat_digits[] =
+    "0001020304050607080910111213141516171819"
+    "2021222324252627282930313233343536373839"
+    "4041424344454647484950515253545556575859"
+    "6061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+
+static const uint64_t xstat_pow10[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+    10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+    100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+    100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+    100000000000000000ULL, 1000000000000000000ULL,
+};
+
+// Decimal digits, two at a time.
+static char *put_u64(char *p, uint64_t val) {
+    char tmp[20];
+    char *t = tmp + sizeof(tmp);
+    uint32_t rem;
+    int n;
+
+    while (val >= 100) {
+        val = div_u64_rem(val, 100, &rem);
+        t -= 2;
+        memcpy(t, &xstat_digits[rem * 2], 2);
+    }
+    if (val >= 10) {
+        t -= 2;
+        memcpy(t, &xstat_digits[val * 2], 2);
+    } else {
+        *--t = '0' + val;
+    }
+    n = tmp + sizeof(tmp) - t;
+    memcpy(p, t, n);
+    return p + n;
+}
+
+// The decimals of a negative scale are only written when not all zero.
+static char *put_value(char *p, struct xstat_field *field, const char *rec) {
+    int64_t val = record_value(field, rec);
+    bool neg = xstat_type_signed(field->type) && val < 0;
+    uint64_t mag = neg ? -val : val;
+    int scale = clamp_t(int, field->scale, -XSTAT_MAX_SCALE, XSTAT_MAX_SCALE);
+    uint64_t whole, frac;
+    char *q;
+
+    if (neg)
+        *p++ = '-';
+    if (scale >= 0)
+        return put_u64(p, mag * xstat_pow10[scale]);
+
+    whole = div64_u64(mag, xstat_pow10[-scale]);
+    frac = mag - whole * xstat_pow10[-scale];
+    p = put_u64(p, whole);
+    if (frac) {
+        *p++ = '.';
+        // Zero padded to -scale digits.
+        q = put_u64(p, frac + xstat_pow10[-scale]);
+        memmove(p, p + 1, q - p - 1);
+        p = q - 1;
+    }
+    return p;
+}
+
+// One record as a JSON object or a CSV row, on one line, or -EFBIG if limit
+// may not hold it; see text_len.
+static int print_record(char *buf, int limit, struct xstat_layout *layout,
+        const char *rec, int format) {
+    char *p = buf;
+    int i;
+
+    if (limit < layout->text_len)
+        return -EFBIG;
+    if (format == XSTAT_FMT_JSON)
+        *p++ = '{';
+    for (i = 0; i < layout->nfields; i++) {
+        if (format == XSTAT_FMT_JSON) {
+            memcpy(p, layout->keys[i].str, layout->keys[i].len);
+            p += layout->keys[i].len;
+        } else if (i > 0) {
+            *p++ = ',';
+        }
+        p = put_value(p, &layout->fields[i], rec);
+    }
+    if (format == XSTAT_FMT_JSON)
+        *p++ = '}';
+    *p++ = '\n';
+    *p = '\0';
+    return p - buf;
+}
+
+// Column names for XSTAT_FMT_CSV.
+static int print_header(char *buf, int limit, struct xstat_layout *layout) {
+    int len = min(layout->header_len, limit - 1);
+    if (len <= 0)
+        return 0;
+    memcpy(buf, layout->header, len);
+    buf[len] = '\0';
+    return len;
+}
+
+// One line with the record size, then one per field: offset, type, scale,
+// unit ("-" if none) and the name, which may contain spaces. -EFBIG if limit
+// does not hold all of it.
+static int print_schema(char *buf, int limit, struct xstat_layout *layout) {
+    struct xstat_field *field;
+    char *ptr = buf;
+    int ret;
+    int i;
+
+    ret = snprintf(ptr, limit, "size %d\n", layout->size);
+    if (ret >= limit)
+        return -EFBIG;
+    ptr += ret;
+    limit -= ret;
+    for (i = 0; i < layout->nfields; i++) {
+        field = &layout->fields[i];
+        ret = snprintf(ptr, limit, "%u %s %d %s %s\n", field->offset,
+                xstat_type_name[field->type], field->scale,
+                field->unit[0] ? field->unit : "-", field->name);
+        if (ret >= limit)
+            return -EFBIG;
+        ptr += ret;
+        limit -= ret;
+    }
+    return ptr - buf;
+}
@@ -0,0 +1,148 @@
+// To be included in xstat.c after hpc_cnt.c
+
+// Top-down (TMA) level 1 and 2 for Haswell. All events are pinned so the
+// fractions are never computed from multiplexed estimates. Cycles come from
+// the fixed counter; level 1 takes four general counters, which is all a
+// thread has with HT on, so level 2 (two more) is only programmed with HT
+// off. Pinned events leave fewer general counters for the raw counters in
+// hpc_cnt.c, see XSTAT_TMA in xstat.h.
+
+enum {
+    TMA_CYC,
+    TMA_IDQ_NOT_DELIVERED,
+    TMA_UOPS_ISSUED,
+    TMA_RETIRE_SLOTS,
+    TMA_RECOVERY_CYC,
+    TMA_NLEVEL1,
+    TMA_STALLS_LDM = TMA_NLEVEL1,
+    TMA_STALLS_SB,
+    TMA_NEVENTS,
+};
+
+static struct perf_event_config tma_configs[TMA_NEVENTS] = {
+    [TMA_CYC] = { .type = PERF_TYPE_HARDWARE, .config = PERF_COUNT_HW_CPU_CYCLES, .pinned = true },
+    // IDQ_UOPS_NOT_DELIVERED.CORE
+    [TMA_IDQ_NOT_DELIVERED] = { .type = PERF_TYPE_RAW, .config = 0x019c, .pinned = true },
+    // UOPS_ISSUED.ANY
+    [TMA_UOPS_ISSUED] = { .type = PERF_TYPE_RAW, .config = 0x010e, .pinned = true },
+    // UOPS_RETIRED.RETIRE_SLOTS
+    [TMA_RETIRE_SLOTS] = { .type = PERF_TYPE_RAW, .config = 0x02c2, .pinned = true },
+    // INT_MISC.RECOVERY_CYCLES, cmask = 1
+    [TMA_RECOVERY_CYC] = { .type = PERF_TYPE_RAW, .config = 0x0100030d, .pinned = true },
+    // CYCLE_ACTIVITY.STALLS_LDM_PENDING, cmask = 6
+    [TMA_STALLS_LDM] = { .type = PERF_TYPE_RAW, .config = 0x060006a3, .pinned = true },
+    // RESOURCE_STALLS.SB
+    [TMA_STALLS_SB] = { .type = PERF_TYPE_RAW, .config = 0x08a2, .pinned = true },
+};
+
+#define TMA_ISSUE_WIDTH 4
+#define TMA_SCALE       1000
+
+// Fractions in per mille, in this order. mem and core stay 0 with HT on.
+enum {
+    TMA_FE,
+    TMA_BS,
+    TMA_RET,
+    TMA_BE,
+    TMA_MEM,
+    TMA_CORE,
+    TMA_NFRACS,
+};
+
+static const char *tma_names[TMA_NFRACS] = {
+    "fe", "bs", "ret", "be", "mem", "core",
+};
+
+struct tma_context {
+    int nevents;
+    void *events[TMA_NEVENTS];
+};
+
+static bool tma_smt_on(const struct cpumask *mask) {
+    int cpu;
+    for_each_cpu_mask(cpu, *mask) {
+        if (cpumask_weight(topology_thread_cpumask(cpu)) > 1)
+            return true;
+    }
+    return false;
+}
+
+static int tma_init(const struct cpumask *mask, void *data, void **ctx) {
+    struct tma_context *tma_ctx = kzalloc(sizeof(struct tma_context), GFP_KERNEL);
+    int i;
+
+    *ctx = tma_ctx;
+    if (!tma_ctx)
+        return -ENOMEM;
+
+    tma_ctx->nevents = tma_smt_on(mask) ? TMA_NLEVEL1 : TMA_NEVENTS;
+    for (i = 0; i < tma_ctx->nevents; i++) {
+        perf_init(mask, &tma_configs[i], &tma_ctx->events[i]);
+    }
+    return 0;
+}
+
+static void tma_exit(void **ctx) {
+    struct tma_context *tma_ctx = (struct tma_context *) *ctx;
+    int i;
+    if (!tma_ctx)
+        return;
+    for (i = 0; i < tma_ctx->nevents; i++) {
+        if (tma_ctx->events[i])
+            perf_exit(&tma_ctx->events[i]);
+    }
+    kfree(tma_ctx);
+}
+
+static uint64_t tma_frac(uint64_t part, uint64_t whole) {
+    if (whole == 0)
+        return 0;
+    if (part > whole)
+        part = whole;
+    return div64_u64(part * TMA_SCALE, whole);
+}
+
+static int tma_fields(struct xstat_field *fields, void *data) {
+    int i;
+    if (fields) {
+        for (i = 0; i < TMA_NFRACS; i++) {
+            xstat_field_init(&fields[i], tma_names[i], "", XSTAT_U16, -3);
+        }
+    }
+    return TMA_NFRACS;
+}
+
+static void tma_sample(void **ctx, uint64_t *frac) {
+    struct tma_context *tma_ctx = (struct tma_context *) *ctx;
+    uint64_t val[TMA_NEVENTS] = {0};
+    uint64_t slots, bad;
+    int i;
+
+    memset(frac, 0, sizeof(uint64_t) * TMA_NFRACS);
+    if (!tma_ctx)
+        return;
+
+    for (i = 0; i < tma_ctx->nevents; i++) {
+        if (tma_ctx->events[i])
+            val[i] = perf_restart(&tma_ctx->events[i], 0);
+    }
+
+    slots = TMA_ISSUE_WIDTH * val[TMA_CYC];
+    bad = val[TMA_UOPS_ISSUED] + TMA_ISSUE_WIDTH * val[TMA_RECOVERY_CYC];
+    bad = bad > val[TMA_RETIRE_SLOTS] ? bad - val[TMA_RETIRE_SLOTS] : 0;
+
+    frac[TMA_FE] = tma_frac(val[TMA_IDQ_NOT_DELIVERED], slots);
+    frac[TMA_BS] = tma_frac(bad, slots);
+    frac[TMA_RET] = tma_frac(val[TMA_RETIRE_SLOTS], slots);
+    if (slots && frac[TMA_FE] + frac[TMA_BS] + frac[TMA_RET] < TMA_SCALE)
+        frac[TMA_BE] = TMA_SCALE - frac[TMA_FE] - frac[TMA_BS] - frac[TMA_RET];
+
+    if (tma_ctx->nevents == TMA_NEVENTS) {
+        frac[TMA_MEM] = tma_frac(val[TMA_STALLS_LDM] + val[TMA_STALLS_SB], val[TMA_CYC]);
+        if (frac[TMA_MEM] > frac[TMA_BE])
+            frac[TMA_MEM] = frac[TMA_BE];
+        frac[TMA_CORE] = frac[TMA_BE] - frac[TMA_MEM];
+    }
+}
+
+static struct xstat_counter tma_counter = __XSTAT_MCNT(tma, tma_init, tma_exit, tma_fields, tma_sample);
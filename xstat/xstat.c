@@ -1,11 +1,23 @@
+#include <linux/cdev.h>
 #include <linux/cpumask.h>
 #include <linux/delay.h>
 #include <linux/device.h>
+#include <linux/fs.h>
+#include <linux/hrtimer.h>
 #include <linux/kthread.h>
 #include <linux/module.h>
+#include <linux/mutex.h>
+#include <linux/pid_namespace.h>
+#include <linux/poll.h>
 #include <linux/sysfs.h>
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/srcu.h>
+#include <linux/tick.h>
+#include <linux/timer.h>
+#include <linux/topology.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Kaicheng Zhang");
@@ -18,16 +30,43 @@ MODULE_DESCRIPTION("X Stat for Intel Processors");
 } while (0)
 
 #include "xstat.h"
+#include "xstat_ioctl.h"
+#define CREATE_TRACE_POINTS
+#include "xstat_trace.h"
+#include "record.c"
 #include "base_cnt.c"
 #include "hpc_cnt.c"
 #include "msr_cnt.c"
+#include "os_cnt.c"
+#ifdef XSTAT_TMA
+#include "tma_cnt.c"
+#endif
 #ifdef XSTAT_IPMI
 #include "ipmi_cnt.c"
+#include "ipmi_sdr.c"
 #endif
 
+// What each record is, and the timing of the node sampler itself, defined
+// with the sampler below.
+static int sampler_ctx_init(const struct cpumask *mask, void *data, void **ctx);
+static int kind_fields(struct xstat_field *fields, void *data);
+static void kind_sample(void **ctx, uint64_t *vals);
+static struct xstat_counter kind_counter = __XSTAT_MCNT(kind, sampler_ctx_init, NULL, kind_fields, kind_sample);
+// Index of kind_counter in node_counters.
+#define XSTAT_KIND_CNT 2
+static int jitter_fields(struct xstat_field *fields, void *data);
+static void jitter_sample(void **ctx, uint64_t *vals);
+static struct xstat_counter jitter_counter = __XSTAT_MCNT(jitter, sampler_ctx_init, NULL, jitter_fields, jitter_sample);
+// Power model over the counters before it, in model.c.
+static int model_init(const struct cpumask *mask, void *data, void **ctx);
+static int model_fields(struct xstat_field *fields, void *data);
+static void model_sample(void **ctx, uint64_t *vals);
+static struct xstat_counter model_counter = __XSTAT_MCNT(model, model_init, NULL, model_fields, model_sample);
+
 static struct xstat_counter *node_counters[] = {
     &ts_counter,
     &intv_counter,
+    &kind_counter,
     &cyc_counter,
     &inst_counter,
     &llcref_counter,
@@ -35,19 +74,88 @@ static struct xstat_counter *node_counters[] = {
     &br_counter,
     &brmiss_counter,
     &l2lin_counter,
+    &lcldram_counter,
+    &rmtdram_counter,
+    &rmthit_counter,
+#ifdef XSTAT_TMA
+    &tma_counter,
+#endif
+    &idlecpu_counter,
+    &os_counter,
     &temp_counter,
     &energy_counter,
     &eunit_counter,
     &perflmt_counter,
+    &smi_counter,
+    &model_counter,
+    &jitter_counter,
 #ifdef XSTAT_IPMI
 #ifdef XSTAT_CHAMELEON
     &xstat_ipmi_cnts[0],
     &xstat_ipmi_cnts[1],
     &xstat_ipmi_cnts[2],
 #endif
+    &xstat_sdr_cnt,
+    &xstat_ipmi_ts_counter,
+    &xstat_dcmi_counter,
 #endif
 };
 
+// Wakeup delay of a sampler past its deadline, in buckets of powers of two
+// microseconds: bucket 0 is below 1us, bucket k from 2^(k-1)us on.
+#define XSTAT_JITTER_NBUCKET 20
+struct xstat_jitter {
+    uint64_t ticks;
+    uint64_t missed;
+    uint64_t max_delay;
+    uint64_t hist[XSTAT_JITTER_NBUCKET];
+    // Since the last record.
+    uint32_t delay_us;
+    uint32_t new_missed;
+};
+
+// DVFS governor of a node, see gov.c.
+struct xstat_gov {
+    bool active;
+    int phase;
+    // Phase of the last records and how many in a row, up to gov_hyst.
+    int next;
+    unsigned int held;
+    unsigned int khz;
+    unsigned int orig_khz;
+};
+
+// Marker from user space, timestamped.
+struct xstat_mark {
+    uint64_t ts;
+    struct xstat_marker m;
+};
+// Queue of pending markers, first and largest sizes.
+#define XSTAT_NPEND 16
+#define XSTAT_NPEND_MAX 256
+
+// Instance of a counter wider than a node. Whichever node sampler comes
+// first in a tick samples it, the others copy its values.
+struct xstat_shared {
+    struct mutex lock;
+    int owner;
+    int users;
+    void *ctx;
+    uint64_t last;
+    uint64_t ts;
+    // Snapshot the values were sampled for, 0 for a tick.
+    uint64_t gen;
+    uint64_t *vals;
+};
+
+// Clock and thermal events of a node's CPUs, see events.c.
+struct xstat_event_ring {
+    spinlock_t lock;
+    // Events logged so far, the last XSTAT_NEVENT in ring.
+    uint64_t seq;
+    struct xstat_event ring[XSTAT_NEVENT];
+};
+
 #define STRBUFLEN    8
 struct xstat_node {
     int id;
@@ -56,48 +164,267 @@ struct xstat_node {
     struct task_struct *task;
 
     const struct cpumask *mask;
+    // Where the sampler runs, one of mask.
+    int cpu;
 
     char stat_name[STRBUFLEN];
     char last_name[STRBUFLEN];
     char reset_name[STRBUFLEN];
+    char cpu_name[STRBUFLEN];
+    char jitter_name[STRBUFLEN * 2];
+    char events_name[STRBUFLEN * 2];
     struct class_attribute stat_attr;
     struct class_attribute last_attr;
     struct class_attribute reset_attr;
+    struct class_attribute cpu_attr;
+    struct class_attribute jitter_attr;
+    struct class_attribute events_attr;
+
+    // Next tick, on the get_time clock.
+    uint64_t deadline;
+    struct xstat_jitter jitter;
+    struct xstat_gov gov;
+    struct xstat_event_ring events;
+
+    // Readers of /dev/xstat<id>, woken once ctrl_watermark records are queued.
+    struct device *dev;
+    wait_queue_head_t wait;
 
     void **ctxs;
-    uint64_t *buffer;
-    uint64_t *working_buf;
+    struct xstat_shared **shared;
+    // Records of the current session, layout->size bytes each.
+    struct xstat_layout *layout;
+    char *buffer;
+    uint64_t *vals;
+    uint64_t *last;
     int buffer_base;
     int buffer_next;
     int buffer_size;
+    // Records committed in the session; the last min(seq, XSTAT_NBUF) stay
+    // in the ring for range queries whether drained or not.
+    uint64_t seq;
+
+    // Record being taken, see kind_sample, and where it is packed.
+    uint8_t rec_kind;
+    uint64_t rec_label;
+    char *rec;
+    // Last snapshot taken, and its record.
+    uint64_t snap_done;
+    char *snap_rec;
+    // Markers that come in while a record is being taken wait for it, so
+    // the ring stays in ts order.
+    bool sampling;
+    int npend;
+    int pend_size;
+    struct xstat_mark *pend;
+
+    // Counter contexts ready for region reads, see region_read.
+    bool ctxs_ready;
+
+    struct xstat_nl_batch *nl;
+    // Event values of the perf PMU, see pmu.c.
+    seqlock_t pmu_lock;
+    uint64_t *pmu_vals;
 };
 
 #define XSTAT_NCNT (sizeof(node_counters) / sizeof(node_counters[0]))
 #define XSTAT_NBUF 256
 
+static int counter_index(struct xstat_counter *cnt) {
+    int i;
+    for (i = 0; i < XSTAT_NCNT; i++) {
+        if (node_counters[i] == cnt)
+            return i;
+    }
+    return -1;
+}
+
 struct xstat_node *xstat_nodes[MAX_NUMNODES];
 
-static spinlock_t ctrl_lock;
+static struct mutex ctrl_lock;
 static unsigned int ctrl_period;
+static unsigned int ctrl_watermark;
+static unsigned int ctrl_format;
 static bool ctrl_on;
+// Snapshots asked for so far and the label of the last one, under ctrl_lock.
+static uint64_t snap_gen;
+static uint64_t snap_label;
+static DECLARE_WAIT_QUEUE_HEAD(snap_wait);
+// Pins the counter contexts of the nodes for region reads.
+static struct srcu_struct region_srcu;
 static int kthread_function(void *data);
+static int start_stat(void);
+static void stop_stat(void);
+static int print_session_schema(char *buf, int limit);
+
+#include "netlink.c"
+#include "pmu.c"
+#include "gov.c"
+#include "cap.c"
+#include "model.c"
+#include "events.c"
+
+// Lays out the records of a new session and drops those of the last one.
+// Sampling is off, so only the readers look at the node.
+static int setup_node(struct xstat_node *node) {
+    struct xstat_layout *layout;
+    char *buffer, *rec, *snap_rec;
+    uint64_t *vals;
+
+    layout = build_layout(node_counters, XSTAT_NCNT);
+    if (!layout)
+        return -ENOMEM;
+    buffer = kzalloc(layout->size * XSTAT_NBUF, GFP_KERNEL);
+    rec = kzalloc(layout->size, GFP_KERNEL);
+    snap_rec = kzalloc(layout->size, GFP_KERNEL);
+    vals = kcalloc(layout->nfields ? layout->nfields : 1, sizeof(uint64_t), GFP_KERNEL);
+    if (!buffer || !rec || !snap_rec || !vals) {
+        kfree(vals);
+        kfree(snap_rec);
+        kfree(rec);
+        kfree(buffer);
+        free_layout(layout);
+        return -ENOMEM;
+    }
+
+    spin_lock_bh(&node->lock);
+    swap(node->layout, layout);
+    swap(node->buffer, buffer);
+    swap(node->vals, vals);
+    swap(node->rec, rec);
+    swap(node->snap_rec, snap_rec);
+    node->buffer_base = 0;
+    node->buffer_next = 0;
+    node->buffer_size = 0;
+    node->seq = 0;
+    node->sampling = false;
+    node->npend = 0;
+    spin_unlock_bh(&node->lock);
+    memset(&node->jitter, 0, sizeof(struct xstat_jitter));
+
+    kfree(vals);
+    kfree(snap_rec);
+    kfree(rec);
+    kfree(buffer);
+    put_layout(layout);
+    return 0;
+}
+
+// Which instance of a scope the node samples from, -1 if it has its own.
+static int scope_id(int scope, struct xstat_node *node) {
+    int cpu = node->cpu;
+    switch (scope) {
+    case XSTAT_SCOPE_SYSTEM:
+        return 0;
+    case XSTAT_SCOPE_PACKAGE:
+        return topology_physical_package_id(cpu);
+    case XSTAT_SCOPE_CORE:
+        return cpumask_first(topology_thread_cpumask(cpu));
+    case XSTAT_SCOPE_THREAD:
+        return cpu;
+    default:
+        return -1;
+    }
+}
+
+static void free_shared(void) {
+    struct xstat_node *node;
+    struct xstat_shared *sh;
+    int i, j;
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        node = xstat_nodes[i];
+        if (!node)
+            continue;
+        for (j = 0; j < XSTAT_NCNT; j++) {
+            sh = node->shared[j];
+            if (sh && sh->owner == i) {
+                kfree(sh->vals);
+                kfree(sh);
+            }
+            node->shared[j] = NULL;
+        }
+    }
+}
+
+// Points the nodes of the same system, package, core or thread at one
+// instance per counter. Needs the session layout for the number of values.
+static int setup_shared(void) {
+    struct xstat_node *node, *peer;
+    struct xstat_shared *sh;
+    int i, j, k, id, scope, nvals;
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        node = xstat_nodes[i];
+        if (!node)
+            continue;
+        for (j = 0; j < XSTAT_NCNT; j++) {
+            scope = node_counters[j]->scope;
+            id = scope_id(scope, node);
+            if (id < 0)
+                continue;
+            sh = NULL;
+            for (k = 0; k < i && !sh; k++) {
+                peer = xstat_nodes[k];
+                if (peer && peer->shared[j] && scope_id(scope, peer) == id)
+                    sh = peer->shared[j];
+            }
+            if (!sh) {
+                nvals = node->layout->nvals[j];
+                sh = kzalloc(sizeof(struct xstat_shared), GFP_KERNEL);
+                if (sh)
+                    sh->vals = kcalloc(nvals ? nvals : 1, sizeof(uint64_t), GFP_KERNEL);
+                if (!sh || !sh->vals) {
+                    kfree(sh);
+                    free_shared();
+                    return -ENOMEM;
+                }
+                mutex_init(&sh->lock);
+                sh->owner = i;
+            }
+            node->shared[j] = sh;
+        }
+    }
+    return 0;
+}
 
 static int start_stat(void) {
     int i;
+    int ret = 0;
     struct xstat_node *node;
 
-    spin_lock(&ctrl_lock);
+    mutex_lock(&ctrl_lock);
     if (!ctrl_on) {
+#ifdef XSTAT_IPMI
+        // Settles the IPMI groups the layout is built from.
+        xstat_ipmi_start();
+#endif
+        for (i = 0; i < MAX_NUMNODES && ret == 0; i++) {
+            if (xstat_nodes[i])
+                ret = setup_node(xstat_nodes[i]);
+        }
+        if (ret == 0)
+            ret = setup_shared();
+        for (i = 0; i < MAX_NUMNODES && ret == 0; i++) {
+            if (xstat_nodes[i]) {
+                xstat_pmu_session(xstat_nodes[i]->layout);
+                break;
+            }
+        }
+        if (ret < 0) {
+#ifdef XSTAT_IPMI
+            xstat_ipmi_stop();
+#endif
+            goto out;
+        }
         ctrl_on = true;
-        
+
         for (i = 0; i < MAX_NUMNODES; i++) {
             if (xstat_nodes[i]) {
                 node = xstat_nodes[i];
-                
+                node->snap_done = snap_gen;
                 node->task = kthread_create_on_node(kthread_function, node,
                         i, "xstat_node%d", i);
                 if (!IS_ERR(node->task)) {
-                    kthread_bind(node->task, cpumask_first(node->mask));
+                    kthread_bind(node->task, node->cpu);
                     wake_up_process(node->task);
                 } else {
                     node->task = NULL;
@@ -105,15 +432,16 @@ static int start_stat(void) {
             }
         }
     }
-    spin_unlock(&ctrl_lock);
-    return 0;
+out:
+    mutex_unlock(&ctrl_lock);
+    return ret;
 }
 
 static void stop_stat(void) {
     int i;
     struct xstat_node *node;
 
-    spin_lock(&ctrl_lock);
+    mutex_lock(&ctrl_lock);
     if (ctrl_on) {
         ctrl_on = false;
 
@@ -124,76 +452,384 @@ static void stop_stat(void) {
                 node->task = NULL;
             }
         }
+        free_shared();
+        for (i = 0; i < MAX_NUMNODES; i++) {
+            if (xstat_nodes[i]) {
+                xstat_nl_flush(xstat_nodes[i]);
+                wake_up_interruptible(&xstat_nodes[i]->wait);
+            }
+        }
+#ifdef XSTAT_IPMI
+        xstat_ipmi_stop();
+#endif
     }
-    spin_unlock(&ctrl_lock);
+    mutex_unlock(&ctrl_lock);
 }
 
 static int init_counters(struct xstat_node *node) {
+    struct xstat_counter *cnt;
+    struct xstat_shared *sh;
     int i;
     for (i = 0; i < XSTAT_NCNT; i++) {
-        if (node_counters[i]->init) {
-            node_counters[i]->init(node->mask, node_counters[i]->data, &node->ctxs[i]);
+        cnt = node_counters[i];
+        sh = node->shared[i];
+        if (sh) {
+            mutex_lock(&sh->lock);
+            if (sh->users++ == 0 && cnt->init)
+                cnt->init(node->mask, cnt->data, &sh->ctx);
+            mutex_unlock(&sh->lock);
+        } else if (cnt->init) {
+            cnt->init(node->mask, cnt->data, &node->ctxs[i]);
         }
     }
     return 0;
 }
 
 static void exit_counters(struct xstat_node *node) {
+    struct xstat_counter *cnt;
+    struct xstat_shared *sh;
     int i;
     for (i = 0; i < XSTAT_NCNT; i++) {
-        if (node_counters[i]->exit) {
-            node_counters[i]->exit(&node->ctxs[i]);
+        cnt = node_counters[i];
+        sh = node->shared[i];
+        if (sh) {
+            mutex_lock(&sh->lock);
+            if (--sh->users == 0 && cnt->exit)
+                cnt->exit(&sh->ctx);
+            mutex_unlock(&sh->lock);
+        } else if (cnt->exit) {
+            cnt->exit(&node->ctxs[i]);
         }
     }
 }
 
-static int roll_buffer(struct xstat_node *node) {
-    int i;
-    for (i = 0; i < XSTAT_NCNT; i++) {
-        node->working_buf[i] = node_counters[i]->restart(&node->ctxs[i],
-                node->working_buf[i]);
+static void sample_counter(struct xstat_counter *cnt, void **ctx, uint64_t *last,
+        uint64_t *vals, int nvals) {
+    if (cnt->sample) {
+        if (nvals > 0)
+            cnt->sample(ctx, vals);
+    } else {
+        *last = cnt->restart(ctx, *last);
+        vals[0] = *last;
     }
-    spin_lock_bh(&node->lock);
-    memcpy(&node->buffer[node->buffer_next * XSTAT_NCNT], node->working_buf, sizeof(uint64_t) * XSTAT_NCNT);
+}
+
+// Values younger than half a period were sampled in this tick by another
+// node. A snapshot only reuses values taken for the same snapshot.
+static void sample_shared(struct xstat_counter *cnt, struct xstat_shared *sh,
+        uint64_t now, uint64_t gen, uint64_t *vals, int nvals) {
+    bool stale;
+    mutex_lock(&sh->lock);
+    if (gen)
+        stale = sh->gen != gen;
+    else
+        stale = sh->gen || !sh->ts || now - sh->ts >= (uint64_t) ctrl_period * 1000000 / 2;
+    if (stale) {
+        sample_counter(cnt, &sh->ctx, &sh->last, sh->vals, nvals);
+        sh->ts = now;
+        sh->gen = gen;
+    }
+    memcpy(vals, sh->vals, sizeof(uint64_t) * nvals);
+    mutex_unlock(&sh->lock);
+}
+
+// Slot of the next record, dropping the oldest if the ring is full. Under
+// node->lock.
+static char *ring_push(struct xstat_node *node) {
+    char *rec = &node->buffer[node->buffer_next * node->layout->size];
     node->buffer_next = (node->buffer_next + 1) % XSTAT_NBUF;
+    node->seq++;
     if (node->buffer_size < XSTAT_NBUF) {
         node->buffer_size++;
     } else {
         node->buffer_base = (node->buffer_base + 1) % XSTAT_NBUF;
     }
+    return rec;
+}
+
+// A record of only ts and the kind fields. Under node->lock.
+static void commit_marker(struct xstat_node *node, struct xstat_mark *mark) {
+    struct xstat_layout *layout = node->layout;
+    struct xstat_field *field = &layout->fields[layout->first[XSTAT_KIND_CNT]];
+    char *rec = ring_push(node);
+    memset(rec, 0, layout->size);
+    record_set(&layout->fields[0], rec, mark->ts);
+    record_set(&field[0], rec, mark->m.tag);
+    record_set(&field[1], rec, mark->m.phase);
+    record_set(&field[2], rec, mark->m.rank);
+    record_set(&field[3], rec, XSTAT_REC_MARKER);
+}
+
+// Takes the record of a tick, or with gen set the node's record of that
+// snapshot, which is also kept in snap_rec.
+static int roll_buffer(struct xstat_node *node, uint64_t gen) {
+    struct xstat_layout *layout = node->layout;
+    uint64_t *vals = node->vals;
+    uint64_t now;
+    uint64_t ts;
+    int size;
+    int i, j;
+    spin_lock_bh(&node->lock);
+    node->sampling = true;
+    spin_unlock_bh(&node->lock);
+    now = get_time();
+    node->rec_kind = gen ? XSTAT_REC_SNAPSHOT : XSTAT_REC_SAMPLE;
+    node->rec_label = gen ? snap_label : 0;
+    if (xstat_idle_aware)
+        xstat_idle_update(node->mask);
+    for (i = 0; i < XSTAT_NCNT; i++) {
+        if (node->shared[i]) {
+            sample_shared(node_counters[i], node->shared[i], now, gen,
+                    &vals[layout->first[i]], layout->nvals[i]);
+        } else {
+            sample_counter(node_counters[i], &node->ctxs[i], &node->last[i],
+                    &vals[layout->first[i]], layout->nvals[i]);
+        }
+    }
+    pack_record(layout, node->rec, vals);
+    ts = record_ts(layout, node->rec);
+    spin_lock_bh(&node->lock);
+    for (j = 0; j < node->npend && node->pend[j].ts < ts; j++)
+        commit_marker(node, &node->pend[j]);
+    memcpy(ring_push(node), node->rec, layout->size);
+    for (; j < node->npend; j++)
+        commit_marker(node, &node->pend[j]);
+    node->npend = 0;
+    node->sampling = false;
+    size = node->buffer_size;
     spin_unlock_bh(&node->lock);
+    if (gen)
+        memcpy(node->snap_rec, node->rec, layout->size);
+    xstat_pmu_update(node, vals);
+    if (!gen) {
+        xstat_gov_update(node, vals);
+        xstat_cap_update(node, vals);
+        xstat_therm_update(node);
+    }
+    trace_xstat_sample(node->id, node->rec, layout->size);
+    xstat_nl_sample(node, node->rec);
+    if (size >= ctrl_watermark) {
+        trace_xstat_wakeup(node->id, size);
+        wake_up_interruptible(&node->wait);
+    }
+    return 0;
+}
+
+static void wake_sampler(unsigned long data) {
+    wake_up_process((struct task_struct *) data);
+}
+
+static bool snap_pending(struct xstat_node *node) {
+    return ACCESS_ONCE(snap_gen) != node->snap_done;
+}
+
+// Sleeps until deadline or a snapshot is asked for. In idle-aware mode the
+// wakeup is deferrable: an idle sampler CPU is not woken for it, the tick
+// waits for the CPU's next wakeup and counts as missed if that is a period or
+// more late.
+static void sampler_sleep(struct xstat_node *node, uint64_t deadline) {
+    struct timer_list timer;
+    uint64_t now = get_time();
+    ktime_t expires;
+
+    if (deadline <= now)
+        return;
+    if (!xstat_idle_aware) {
+        expires = ns_to_ktime(deadline);
+        set_current_state(TASK_INTERRUPTIBLE);
+        if (!kthread_should_stop() && !snap_pending(node))
+            schedule_hrtimeout_range(&expires, current->timer_slack_ns, HRTIMER_MODE_ABS);
+        __set_current_state(TASK_RUNNING);
+        return;
+    }
+    setup_deferrable_timer_on_stack(&timer, wake_sampler, (unsigned long) current);
+    set_current_state(TASK_INTERRUPTIBLE);
+    mod_timer(&timer, jiffies + usecs_to_jiffies(div_u64(deadline - now, 1000)));
+    if (!kthread_should_stop() && !snap_pending(node))
+        schedule();
+    __set_current_state(TASK_RUNNING);
+    del_timer_sync(&timer);
+    destroy_timer_on_stack(&timer);
+}
+
+static void jitter_wakeup(struct xstat_jitter *jitter, uint64_t delay) {
+    uint64_t us = div_u64(delay, 1000);
+    int bucket = min(fls64(us), XSTAT_JITTER_NBUCKET - 1);
+    jitter->ticks++;
+    jitter->hist[bucket]++;
+    if (delay > jitter->max_delay)
+        jitter->max_delay = delay;
+    jitter->delay_us = min_t(uint64_t, us, 0xffffffff);
+}
+
+static int sampler_ctx_init(const struct cpumask *mask, void *data, void **ctx) {
+    *ctx = xstat_nodes[cpu_to_node(cpumask_first(mask))];
     return 0;
 }
 
+// label is the snapshot label or the marker tag; phase and rank are only set
+// in markers.
+static int kind_fields(struct xstat_field *fields, void *data) {
+    if (fields) {
+        xstat_field_init(&fields[0], "label", "", XSTAT_U64, 0);
+        xstat_field_init(&fields[1], "phase", "", XSTAT_U32, 0);
+        xstat_field_init(&fields[2], "rank", "", XSTAT_U32, 0);
+        xstat_field_init(&fields[3], "kind", "", XSTAT_U8, 0);
+    }
+    return 4;
+}
+
+static void kind_sample(void **ctx, uint64_t *vals) {
+    struct xstat_node *node = (struct xstat_node *) *ctx;
+    vals[0] = node->rec_label;
+    vals[1] = 0;
+    vals[2] = 0;
+    vals[3] = node->rec_kind;
+}
+
+static int jitter_fields(struct xstat_field *fields, void *data) {
+    if (fields) {
+        xstat_field_init(&fields[0], "delay", "us", XSTAT_U32, 0);
+        xstat_field_init(&fields[1], "missed", "", XSTAT_U16, 0);
+        fields[1].flags = XSTAT_FIELD_DELTA;
+    }
+    return 2;
+}
+
+// Wakeup delay of this tick, and deadlines missed since the last record.
+static void jitter_sample(void **ctx, uint64_t *vals) {
+    struct xstat_node *node = (struct xstat_node *) *ctx;
+    vals[0] = node->jitter.delay_us;
+    vals[1] = min_t(uint32_t, node->jitter.new_missed, 0xffff);
+    node->jitter.new_missed = 0;
+}
+
+// Ticks are due at fixed deadlines a period apart; a tick that cannot make
+// its deadline is skipped and counted as missed.
 static int kthread_function(void *data) {
     struct xstat_node *node = (struct xstat_node *) data;
-    int tosleep;
-    uint64_t after_roll;
+    uint64_t period, now, gen;
 
     init_counters(node);
+    smp_wmb();
+    ACCESS_ONCE(node->ctxs_ready) = true;
+    node->deadline = get_time();
 
     while (true) {
-        roll_buffer(node);
-        after_roll = get_time();
-        tosleep = (after_roll - (uint64_t) node->ctxs[1]) / 1000000;
-        tosleep = ctrl_period - tosleep - 1;
-        if (tosleep <= 0) tosleep = 0;
-        if (tosleep > ctrl_period) tosleep = ctrl_period;
-        if (kthread_should_stop()) goto out;
-        if (tosleep) {
-            msleep(tosleep);
-        } else {
-            schedule();
+        roll_buffer(node, 0);
+        period = (uint64_t) ctrl_period * 1000000;
+        node->deadline += period;
+        now = get_time();
+        if (now >= node->deadline) {
+            trace_xstat_deadline_miss(node->id, ctrl_period, now - node->deadline + period);
+            while (node->deadline <= now) {
+                node->deadline += period;
+                node->jitter.missed++;
+                node->jitter.new_missed++;
+            }
         }
+        // Snapshots are taken in between ticks.
+        do {
+            if (kthread_should_stop()) goto out;
+            sampler_sleep(node, node->deadline);
+            gen = ACCESS_ONCE(snap_gen);
+            if (gen != node->snap_done) {
+                smp_rmb();
+                roll_buffer(node, gen);
+                smp_wmb();
+                node->snap_done = gen;
+                wake_up(&snap_wait);
+            }
+        } while (get_time() < node->deadline);
         if (kthread_should_stop()) goto out;
+        now = get_time();
+        jitter_wakeup(&node->jitter, now > node->deadline ? now - node->deadline : 0);
+        // Moved through cpu<id> while running.
+        if (ACCESS_ONCE(node->cpu) != raw_smp_processor_id())
+            set_cpus_allowed_ptr(current, cpumask_of(node->cpu));
+        per_cpu(xstat_noise, raw_smp_processor_id()).wakeups++;
     }
 
 out:
+    xstat_gov_stop(node);
+    xstat_cap_stop(node);
+    ACCESS_ONCE(node->ctxs_ready) = false;
+    synchronize_srcu(&region_srcu);
     exit_counters(node);
 
     return 0;
 }
 
+static bool snap_taken(uint64_t gen) {
+    struct xstat_node *node;
+    int i;
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        node = xstat_nodes[i];
+        if (node && node->task && ACCESS_ONCE(node->snap_done) != gen)
+            return false;
+    }
+    return true;
+}
+
+// Has every sampler take a record tagged with label right away and waits for
+// them; the samplers run on their own CPUs, so the nodes are sampled at once.
+// If recs is set it gets the records, each after the __u32 id of its node and
+// 4 bytes of padding. Returns the number of records.
+static int take_snapshot(uint64_t label, char **recs, int *size) {
+    struct xstat_node *node;
+    uint64_t gen;
+    char *ptr = NULL;
+    int i, n = 0;
+    int ret = 0;
+
+    mutex_lock(&ctrl_lock);
+    if (!ctrl_on) {
+        ret = -ENODATA;
+        goto out;
+    }
+    snap_label = label;
+    smp_wmb();
+    gen = ++snap_gen;
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        node = xstat_nodes[i];
+        if (node && node->task)
+            wake_up_process(node->task);
+    }
+    if (!wait_event_timeout(snap_wait, snap_taken(gen), HZ)) {
+        ret = -ETIMEDOUT;
+        goto out;
+    }
+    smp_rmb();
+    if (!recs)
+        goto out;
+
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        node = xstat_nodes[i];
+        if (node && node->task) {
+            *size = node->layout->size;
+            n++;
+        }
+    }
+    ptr = *recs = kzalloc((n ? n : 1) * (8 + *size), GFP_KERNEL);
+    if (!ptr) {
+        ret = -ENOMEM;
+        goto out;
+    }
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        node = xstat_nodes[i];
+        if (node && node->task) {
+            *(uint32_t *) ptr = i;
+            memcpy(ptr + 8, node->snap_rec, *size);
+            ptr += 8 + *size;
+        }
+    }
+    ret = n;
+
+out:
+    mutex_unlock(&ctrl_lock);
+    return ret;
+}
+
 static ssize_t show_ctrl_attr(
         struct class *class,
         struct class_attribute *attr,
@@ -235,81 +871,235 @@ static ssize_t store_period_attr(
     int ret;
     ret = kstrtoul(buf, 0, &tmp);
     if (ret == 0 && tmp > 0 && tmp < 10000) {
-        spin_lock_bh(&ctrl_lock);
+        mutex_lock(&ctrl_lock);
         ctrl_period = tmp;
-        spin_unlock_bh(&ctrl_lock);
+        mutex_unlock(&ctrl_lock);
     }
     return count;
 
     return 0;
 }
 
-static ssize_t store_reset_attr(
+static ssize_t show_watermark_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        char *buf) {
+    return sprintf(buf, "%u\n", ctrl_watermark);
+}
+
+static ssize_t store_watermark_attr(
         struct class *class,
         struct class_attribute *attr,
         const char *buf,
         size_t count) {
-    struct xstat_node *node = container_of(attr, struct xstat_node, reset_attr);
-    if (count > 0) {
-        spin_lock_bh(&node->lock);
-        node->buffer_size = 0;
-        node->buffer_base = node->buffer_next;
-        spin_unlock_bh(&node->lock);
+    unsigned long tmp;
+    int ret;
+    ret = kstrtoul(buf, 0, &tmp);
+    if (ret == 0 && tmp > 0 && tmp <= XSTAT_NBUF) {
+        ctrl_watermark = tmp;
     }
     return count;
 }
 
-static int print_buffer(char *charbuf, int limit, struct xstat_node *node, uint64_t *buf) {
-    char *ptr = charbuf;
-    int ret;
-    int i;
+static const char *xstat_format_names[] = {
+    [XSTAT_FMT_JSON] = "json",
+    [XSTAT_FMT_CSV] = "csv",
+};
 
-    ret = scnprintf(ptr, limit, "{");
-    CHECK_RET(ret);
-    ptr += ret;
-    limit -= ret;
+static ssize_t show_format_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        char *buf) {
+    return sprintf(buf, "%s\n", xstat_format_names[ctrl_format]);
+}
 
-    for (i = 0; i < XSTAT_NCNT; i++) {
-        if (node_counters[i]->scnprintf != NULL) {
-            ret = node_counters[i]->scnprintf(ptr, limit, buf[i], &node->ctxs[i]);
-            CHECK_RET(ret);
-            ptr += ret;
-            limit -= ret;
-        } else {
-            ret = scnprintf(ptr, limit, "\"%s\":%llu", node_counters[i]->name, buf[i]);
-            CHECK_RET(ret);
-            ptr += ret;
-            limit -= ret;
-        }
-        if (i != XSTAT_NCNT - 1) {
-            ret = scnprintf(ptr, limit, ",");
-            CHECK_RET(ret);
-            ptr += ret;
-            limit -= ret;
-        }
+// csv rows follow the schema; /dev/xstat<id> starts them with a header.
+static ssize_t store_format_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        const char *buf,
+        size_t count) {
+    if (count >= 4 && strncmp(buf, "json", 4) == 0) {
+        ctrl_format = XSTAT_FMT_JSON;
+    }
+    if (count >= 3 && strncmp(buf, "csv", 3) == 0) {
+        ctrl_format = XSTAT_FMT_CSV;
     }
+    return count;
+}
 
-    ret = scnprintf(ptr, limit, "}\n");
+// Writing a label takes a snapshot, left in the rings.
+static ssize_t store_snapshot_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        const char *buf,
+        size_t count) {
+    unsigned long long label;
+    int ret;
+    ret = kstrtoull(buf, 0, &label);
     CHECK_RET(ret);
+    ret = take_snapshot(label, NULL, NULL);
+    CHECK_RET(ret);
+    return count;
+}
+
+static ssize_t show_cpu_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        char *buf) {
+    struct xstat_node *node = container_of(attr, struct xstat_node, cpu_attr);
+    return sprintf(buf, "%d\n", node->cpu);
+}
+
+static ssize_t store_cpu_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        const char *buf,
+        size_t count) {
+    struct xstat_node *node = container_of(attr, struct xstat_node, cpu_attr);
+    int cpu;
+    int ret;
+    ret = kstrtoint(buf, 0, &cpu);
+    if (ret < 0)
+        return ret;
+    if (cpu < 0 || cpu >= nr_cpu_ids || !cpumask_test_cpu(cpu, node->mask) ||
+            !cpu_online(cpu))
+        return -EINVAL;
+    node->cpu = cpu;
+    return count;
+}
+
+// Whether cpu is left to the kernel. The kernel keeps init off the isolcpus
+// CPUs, so they are those init may not run on.
+static bool housekeeping_cpu(int cpu) {
+    struct task_struct *init;
+    bool ret = true;
+    rcu_read_lock();
+    init = pid_task(find_pid_ns(1, &init_pid_ns), PIDTYPE_PID);
+    if (init)
+        ret = cpumask_test_cpu(cpu, tsk_cpus_allowed(init));
+    rcu_read_unlock();
+    return ret;
+}
+
+// The first CPU of the node neither isolated nor running nohz_full, so by
+// default samplers stay off the CPUs set aside for applications.
+static int default_sampler_cpu(const struct cpumask *mask) {
+    int cpu;
+    for_each_cpu(cpu, mask) {
+        if (housekeeping_cpu(cpu) && !tick_nohz_full_cpu(cpu))
+            return cpu;
+    }
+    return cpumask_first(mask);
+}
+
+static ssize_t show_noise_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        char *buf) {
+    struct xstat_noise *noise;
+    int limit = PAGE_SIZE;
+    char *ptr = buf;
+    int ret;
+    int cpu;
+
+    ret = scnprintf(ptr, limit, "cpu wakeups ipis\n");
     ptr += ret;
     limit -= ret;
+    for_each_online_cpu(cpu) {
+        noise = &per_cpu(xstat_noise, cpu);
+        if (!noise->wakeups && !noise->ipis)
+            continue;
+        ret = scnprintf(ptr, limit, "%d %lu %lu\n", cpu, noise->wakeups, noise->ipis);
+        ptr += ret;
+        limit -= ret;
+    }
+    return ptr - buf;
+}
 
-    return ptr - charbuf;
+static ssize_t store_noise_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        const char *buf,
+        size_t count) {
+    int cpu;
+    for_each_possible_cpu(cpu) {
+        memset(&per_cpu(xstat_noise, cpu), 0, sizeof(struct xstat_noise));
+    }
+    return count;
 }
 
-static ssize_t show_stat_attr(
+static ssize_t show_idle_attr(
         struct class *class,
         struct class_attribute *attr,
         char *buf) {
+    return sprintf(buf, "%d\n", xstat_idle_aware);
+}
+
+static ssize_t store_idle_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        const char *buf,
+        size_t count) {
+    bool tmp;
+    int ret;
+    ret = strtobool(buf, &tmp);
+    if (ret == 0) {
+        xstat_idle_aware = tmp;
+    }
+    return count;
+}
+
+static ssize_t show_jitter_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        char *buf) {
+    struct xstat_node *node = container_of(attr, struct xstat_node, jitter_attr);
+    struct xstat_jitter *jitter = &node->jitter;
     int limit = PAGE_SIZE;
+    char *ptr = buf;
     int ret;
+    int i;
+
+    ret = scnprintf(ptr, limit, "ticks %llu\nmissed %llu\nmax_us %llu\n",
+            jitter->ticks, jitter->missed, div_u64(jitter->max_delay, 1000));
+    ptr += ret;
+    limit -= ret;
+    // Lower bound of each bucket in us, and its count.
+    for (i = 0; i < XSTAT_JITTER_NBUCKET; i++) {
+        ret = scnprintf(ptr, limit, "%lu %llu\n", i ? 1UL << (i - 1) : 0UL, jitter->hist[i]);
+        ptr += ret;
+        limit -= ret;
+    }
+    return ptr - buf;
+}
+
+static ssize_t store_reset_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        const char *buf,
+        size_t count) {
+    struct xstat_node *node = container_of(attr, struct xstat_node, reset_attr);
+    if (count > 0) {
+        spin_lock_bh(&node->lock);
+        node->buffer_size = 0;
+        node->buffer_base = node->buffer_next;
+        spin_unlock_bh(&node->lock);
+    }
+    return count;
+}
+
+// Moves records out of the ring while buf has room for the longest one.
+static int drain_buffer(struct xstat_node *node, char *buf, int size) {
+    int limit = size;
+    int ret = 0;
     int count = 0;
     char *ptr = buf;
-    struct xstat_node *node = container_of(attr, struct xstat_node, stat_attr);
 
     spin_lock_bh(&node->lock);
-    while (limit > (PAGE_SIZE / 2) && node->buffer_size > 0) {
-        ret = print_buffer(ptr, limit, node, &node->buffer[node->buffer_base * XSTAT_NCNT]);
+    while (node->buffer_size > 0) {
+        ret = print_record(ptr, limit, node->layout,
+                &node->buffer[node->buffer_base * node->layout->size], ctrl_format);
         if (ret < 0) {
             break;
         }
@@ -320,7 +1110,16 @@ static ssize_t show_stat_attr(
         node->buffer_size--;
     }
     spin_unlock_bh(&node->lock);
-    return count;
+    // Records too long for the attr are left for /dev/xstat<id>.
+    return count ? count : ret;
+}
+
+static ssize_t show_stat_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        char *buf) {
+    struct xstat_node *node = container_of(attr, struct xstat_node, stat_attr);
+    return drain_buffer(node, buf, PAGE_SIZE);
 }
 
 static ssize_t show_last_attr(
@@ -331,21 +1130,525 @@ static ssize_t show_last_attr(
     int buffer_last;
     int ret = 0;
     spin_lock_bh(&node->lock);
-    buffer_last = (XSTAT_NBUF + node->buffer_next - 1) % XSTAT_NBUF;
-    ret = print_buffer(buf, PAGE_SIZE, node, &node->buffer[buffer_last * XSTAT_NCNT]);
+    if (node->layout) {
+        buffer_last = (XSTAT_NBUF + node->buffer_next - 1) % XSTAT_NBUF;
+        ret = print_record(buf, PAGE_SIZE, node->layout,
+                &node->buffer[buffer_last * node->layout->size], ctrl_format);
+    }
     spin_unlock_bh(&node->lock);
     return ret;
 }
 
+// Record layout of the current session, the same for all nodes, or -EFBIG
+// if it does not fit in limit.
+static int print_session_schema(char *buf, int limit) {
+    struct xstat_node *node;
+    int ret = 0;
+    int i;
+    buf[0] = '\0';
+    for (i = 0; i < MAX_NUMNODES; i++) {
+        node = xstat_nodes[i];
+        if (node) {
+            spin_lock_bh(&node->lock);
+            if (node->layout)
+                ret = print_schema(buf, limit, node->layout);
+            spin_unlock_bh(&node->lock);
+            break;
+        }
+    }
+    return ret;
+}
+
+static ssize_t show_schema_attr(
+        struct class *class,
+        struct class_attribute *attr,
+        char *buf) {
+    return print_session_schema(buf, PAGE_SIZE);
+}
+
+static bool xstat_readable(struct xstat_node *node) {
+    return ACCESS_ONCE(node->buffer_size) >= ctrl_watermark;
+}
+
+// Counts of one CPU at the start of a region.
+#define XSTAT_NREGION_CNT 3
+struct xstat_region_start {
+    bool open;
+    int cpu;
+    uint64_t ts;
+    uint32_t energy;
+    int eunit;
+    uint64_t count[XSTAT_NREGION_CNT];
+    uint64_t enabled[XSTAT_NREGION_CNT];
+    uint64_t running[XSTAT_NREGION_CNT];
+};
+
+static struct xstat_counter *region_counters[XSTAT_NREGION_CNT] = {
+    &cyc_counter,
+    &inst_counter,
+    &llcmiss_counter,
+};
+
+// Per open /dev/xstat<id>: records taken off the ring in one go, and the
+// text of the one being copied out, so a short read resumes where it
+// stopped. In CSV the header goes out once per open and session.
+struct xstat_reader {
+    struct xstat_node *node;
+    // Serializes read() and the queries of threads sharing the file.
+    struct mutex lock;
+    struct xstat_layout *layout;
+    bool header_done;
+    char *recs;
+    int nrecs;
+    int irec;
+    // Text of one record, sized to the layout.
+    char *text;
+    int text_size;
+    int len;
+    int pos;
+    struct xstat_region_start regions[XSTAT_NREGION];
+};
+
+// Draining the ring, snapshots and markers change what every other reader
+// sees, so they need the device open for writing or CAP_SYS_ADMIN; regions,
+// ranges and events are open to all.
+static bool xstat_privileged(struct file *file) {
+    return (file->f_mode & FMODE_WRITE) || capable(CAP_SYS_ADMIN);
+}
+
+static int xstat_open(struct inode *inode, struct file *file) {
+    struct xstat_reader *r;
+    int nid = iminor(inode);
+    if (nid >= MAX_NUMNODES || !xstat_nodes[nid])
+        return -ENODEV;
+    r = kzalloc(sizeof(struct xstat_reader), GFP_KERNEL);
+    if (!r)
+        return -ENOMEM;
+    r->recs = (char *) __get_free_page(GFP_KERNEL);
+    r->text = kmalloc(PAGE_SIZE, GFP_KERNEL);
+    r->text_size = PAGE_SIZE;
+    if (!r->recs || !r->text) {
+        kfree(r->text);
+        free_page((unsigned long) r->recs);
+        kfree(r);
+        return -ENOMEM;
+    }
+    mutex_init(&r->lock);
+    r->node = xstat_nodes[nid];
+    file->private_data = r;
+    return nonseekable_open(inode, file);
+}
+
+static int xstat_release(struct inode *inode, struct file *file) {
+    struct xstat_reader *r = file->private_data;
+    put_layout(r->layout);
+    kfree(r->text);
+    free_page((unsigned long) r->recs);
+    kfree(r);
+    return 0;
+}
+
+// Copies a page worth of records off the ring; they are formatted later
+// without the lock.
+static int pop_records(struct xstat_reader *r) {
+    struct xstat_node *node = r->node;
+    int size;
+    int n = 0;
+
+    spin_lock_bh(&node->lock);
+    if (node->buffer_size > 0) {
+        if (r->layout != node->layout) {
+            put_layout(r->layout);
+            r->layout = node->layout;
+            get_layout(r->layout);
+            r->header_done = false;
+        }
+        size = r->layout->size;
+        while (node->buffer_size > 0 && (n + 1) * size <= PAGE_SIZE) {
+            memcpy(&r->recs[n * size], &node->buffer[node->buffer_base * size], size);
+            node->buffer_base = (node->buffer_base + 1) % XSTAT_NBUF;
+            node->buffer_size--;
+            n++;
+        }
+    }
+    spin_unlock_bh(&node->lock);
+    r->nrecs = n;
+    r->irec = 0;
+    return n;
+}
+
+// Same records as stat<id>, as many as are queued and fit in count. Blocks
+// until the watermark is reached or sampling stops.
+static ssize_t xstat_read(struct file *file, char __user *ubuf, size_t count,
+        loff_t *ppos) {
+    struct xstat_reader *r = file->private_data;
+    struct xstat_node *node = r->node;
+    size_t copied = 0;
+    size_t n;
+    char *text;
+    int format;
+    ssize_t ret;
+
+    if (!xstat_privileged(file))
+        return -EPERM;
+    if (mutex_lock_interruptible(&r->lock))
+        return -ERESTARTSYS;
+    while (copied < count) {
+        if (r->pos < r->len) {
+            n = min_t(size_t, r->len - r->pos, count - copied);
+            if (copy_to_user(ubuf + copied, r->text + r->pos, n)) {
+                ret = copied ? copied : -EFAULT;
+                goto out;
+            }
+            r->pos += n;
+            copied += n;
+            continue;
+        }
+        if (r->irec == r->nrecs && pop_records(r) == 0) {
+            if (copied)
+                break;
+            if (file->f_flags & O_NONBLOCK) {
+                ret = -EAGAIN;
+                goto out;
+            }
+            ret = wait_event_interruptible(node->wait, xstat_readable(node) || !ctrl_on);
+            if (ret < 0)
+                goto out;
+            if (ACCESS_ONCE(node->buffer_size) == 0)
+                break;
+            continue;
+        }
+        if (r->text_size < r->layout->text_len) {
+            text = kmalloc(r->layout->text_len, GFP_KERNEL);
+            if (!text) {
+                ret = copied ? copied : -ENOMEM;
+                goto out;
+            }
+            kfree(r->text);
+            r->text = text;
+            r->text_size = r->layout->text_len;
+        }
+        format = ctrl_format;
+        if (format == XSTAT_FMT_CSV && !r->header_done) {
+            r->len = print_header(r->text, r->text_size, r->layout);
+            r->header_done = true;
+        } else {
+            r->len = print_record(r->text, r->text_size, r->layout,
+                    &r->recs[r->irec * r->layout->size], format);
+            r->irec++;
+        }
+        r->pos = 0;
+    }
+    ret = copied;
+out:
+    mutex_unlock(&r->lock);
+    return ret;
+}
+
+static char *ring_record(struct xstat_node *node, uint64_t seq) {
+    return &node->buffer[(seq % XSTAT_NBUF) * node->layout->size];
+}
+
+// First sequence number in [lo, hi) with ts >= t, or ts > t if after.
+static uint64_t find_ts(struct xstat_node *node, uint64_t lo, uint64_t hi,
+        uint64_t t, bool after) {
+    uint64_t mid, ts;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        ts = record_ts(node->layout, ring_record(node, mid));
+        if (ts < t || (after && ts == t))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static long xstat_ioctl_range(struct xstat_reader *r, struct xstat_range __user *uarg) {
+    struct xstat_node *node = r->node;
+    struct xstat_layout *layout;
+    struct xstat_range q;
+    char __user *ubuf;
+    char *page;
+    uint64_t oldest, lo, hi, s;
+    int size, n;
+    long ret = 0;
+
+    if (copy_from_user(&q, uarg, sizeof(q)))
+        return -EFAULT;
+    page = (char *) __get_free_page(GFP_KERNEL);
+    if (!page)
+        return -ENOMEM;
+
+    spin_lock_bh(&node->lock);
+    layout = node->layout;
+    if (!layout || node->seq == 0) {
+        spin_unlock_bh(&node->lock);
+        q.size = layout ? layout->size : 0;
+        q.nrecs = 0;
+        q.seq = 0;
+        goto out;
+    }
+    size = layout->size;
+    oldest = node->seq - min_t(uint64_t, node->seq, XSTAT_NBUF);
+    hi = find_ts(node, oldest, node->seq, q.t1, true);
+    if (q.flags & XSTAT_RANGE_LAST) {
+        lo = hi - min_t(uint64_t, hi - oldest, q.count);
+    } else {
+        lo = find_ts(node, oldest, hi, q.t0, false);
+        if (q.count && hi - lo > q.count)
+            hi = lo + q.count;
+    }
+    hi = min_t(uint64_t, hi, lo + div64_u64(q.len, size));
+    get_layout(layout);
+    spin_unlock_bh(&node->lock);
+
+    // A page at a time; stops early if the sampler overwrote the rest.
+    ubuf = (char __user *) (unsigned long) q.buf;
+    for (s = lo; s < hi; s += n) {
+        n = min_t(uint64_t, hi - s, PAGE_SIZE / size);
+        spin_lock_bh(&node->lock);
+        if (node->layout != layout ||
+                s < node->seq - min_t(uint64_t, node->seq, XSTAT_NBUF)) {
+            spin_unlock_bh(&node->lock);
+            break;
+        }
+        if (s % XSTAT_NBUF + n > XSTAT_NBUF)
+            n = XSTAT_NBUF - s % XSTAT_NBUF;
+        memcpy(page, ring_record(node, s), n * size);
+        spin_unlock_bh(&node->lock);
+        if (copy_to_user(ubuf + (s - lo) * size, page, n * size)) {
+            ret = -EFAULT;
+            break;
+        }
+    }
+    put_layout(layout);
+    q.size = size;
+    q.nrecs = s - lo;
+    q.seq = lo;
+
+out:
+    free_page((unsigned long) page);
+    if (ret == 0 && copy_to_user(uarg, &q, sizeof(q)))
+        ret = -EFAULT;
+    return ret;
+}
+
+static long xstat_ioctl_snapshot(struct xstat_snapshot __user *uarg) {
+    struct xstat_snapshot q;
+    char *recs;
+    int size = 0;
+    int ret;
+
+    if (copy_from_user(&q, uarg, sizeof(q)))
+        return -EFAULT;
+    ret = take_snapshot(q.label, &recs, &size);
+    CHECK_RET(ret);
+    q.size = size;
+    q.nrecs = min_t(uint64_t, ret, div64_u64(q.len, 8 + size));
+    if (copy_to_user((char __user *) (unsigned long) q.buf, recs, q.nrecs * (8 + size)) ||
+            copy_to_user(uarg, &q, sizeof(q)))
+        ret = -EFAULT;
+    kfree(recs);
+    return ret < 0 ? ret : 0;
+}
+
+// Commits a marker to the ring of the node, behind the record being taken
+// if any.
+static long xstat_ioctl_marker(struct xstat_node *node, struct xstat_marker __user *uarg) {
+    struct xstat_mark mark, *pend;
+    int size;
+
+    if (copy_from_user(&mark.m, uarg, sizeof(mark.m)))
+        return -EFAULT;
+    spin_lock_bh(&node->lock);
+    if (!ACCESS_ONCE(ctrl_on) || !node->layout) {
+        spin_unlock_bh(&node->lock);
+        return -ENODATA;
+    }
+    mark.ts = get_time();
+    if (node->sampling) {
+        // Grows rather than commit markers out of ts order.
+        if (node->npend == node->pend_size) {
+            size = node->pend_size ? 2 * node->pend_size : XSTAT_NPEND;
+            pend = NULL;
+            if (size <= XSTAT_NPEND_MAX)
+                pend = krealloc(node->pend, size * sizeof(struct xstat_mark), GFP_ATOMIC);
+            if (!pend) {
+                spin_unlock_bh(&node->lock);
+                return -ENOSPC;
+            }
+            node->pend = pend;
+            node->pend_size = size;
+        }
+        node->pend[node->npend++] = mark;
+    } else {
+        commit_marker(node, &mark);
+    }
+    size = node->buffer_size;
+    spin_unlock_bh(&node->lock);
+    if (size >= ctrl_watermark)
+        wake_up_interruptible(&node->wait);
+    return 0;
+}
+
+// What the calling CPU has counted so far, read from the events its node
+// sampler opened on it, and the energy of its package. Should the thread move
+// meanwhile these are still the counts of cpu, read with an IPI. The sampler
+// waits for region_srcu readers before closing the events.
+static int region_read(struct xstat_region_start *rd) {
+    struct xstat_node *node;
+    int cpu = raw_smp_processor_id();
+    int i, idx, ret = 0;
+
+    idx = srcu_read_lock(&region_srcu);
+    node = xstat_nodes[cpu_to_node(cpu)];
+    if (!node || !ACCESS_ONCE(node->ctxs_ready)) {
+        ret = -ENODATA;
+        goto out;
+    }
+    smp_rmb();
+    rd->cpu = cpu;
+    rd->ts = get_time();
+    for (i = 0; i < XSTAT_NREGION_CNT && ret == 0; i++) {
+        ret = perf_read_cpu(node->ctxs[counter_index(region_counters[i])], cpu,
+                &rd->count[i], &rd->enabled[i], &rd->running[i]);
+    }
+    if (ret == 0)
+        ret = energy_read_cpu(cpu, &rd->energy, &rd->eunit);
+out:
+    srcu_read_unlock(&region_srcu, idx);
+    return ret;
+}
+
+static long xstat_ioctl_region(struct xstat_reader *r, struct xstat_region __user *uarg) {
+    struct xstat_region q;
+    struct xstat_region_start now, *start;
+    uint64_t vals[XSTAT_NREGION_CNT];
+    int i, ret;
+
+    if (copy_from_user(&q, uarg, sizeof(q)))
+        return -EFAULT;
+    if (q.id >= XSTAT_NREGION)
+        return -EINVAL;
+    start = &r->regions[q.id];
+    ret = region_read(&now);
+    CHECK_RET(ret);
+
+    switch (q.op) {
+    case XSTAT_REGION_BEGIN:
+        *start = now;
+        start->open = true;
+        return 0;
+    case XSTAT_REGION_END:
+        if (!start->open)
+            return -EINVAL;
+        start->open = false;
+        if (now.cpu != start->cpu)
+            return -EXDEV;
+        for (i = 0; i < XSTAT_NREGION_CNT; i++) {
+            vals[i] = perf_scale(now.count[i] - start->count[i],
+                    now.enabled[i] - start->enabled[i],
+                    now.running[i] - start->running[i]);
+        }
+        q.ns = now.ts - start->ts;
+        q.energy = ((uint64_t) (uint32_t) (now.energy - start->energy) * 1000000) >> now.eunit;
+        q.cycles = vals[0];
+        q.instructions = vals[1];
+        q.llcmiss = vals[2];
+        if (copy_to_user(uarg, &q, sizeof(q)))
+            return -EFAULT;
+        return 0;
+    default:
+        return -EINVAL;
+    }
+}
+
+static long xstat_ioctl(struct file *file, unsigned int cmd, unsigned long arg) {
+    struct xstat_reader *r = file->private_data;
+    long ret;
+    switch (cmd) {
+    case XSTAT_IOC_RANGE:
+        if (mutex_lock_interruptible(&r->lock))
+            return -ERESTARTSYS;
+        ret = xstat_ioctl_range(r, (struct xstat_range __user *) arg);
+        mutex_unlock(&r->lock);
+        return ret;
+    case XSTAT_IOC_SNAPSHOT:
+        if (!xstat_privileged(file))
+            return -EPERM;
+        return xstat_ioctl_snapshot((struct xstat_snapshot __user *) arg);
+    case XSTAT_IOC_MARKER:
+        if (!xstat_privileged(file))
+            return -EPERM;
+        return xstat_ioctl_marker(r->node, (struct xstat_marker __user *) arg);
+    case XSTAT_IOC_REGION:
+        if (mutex_lock_interruptible(&r->lock))
+            return -ERESTARTSYS;
+        ret = xstat_ioctl_region(r, (struct xstat_region __user *) arg);
+        mutex_unlock(&r->lock);
+        return ret;
+    case XSTAT_IOC_EVENTS:
+        return xstat_ioctl_events(r->node, (struct xstat_events __user *) arg);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static unsigned int xstat_poll(struct file *file, poll_table *wait) {
+    struct xstat_reader *r = file->private_data;
+    struct xstat_node *node = r->node;
+    poll_wait(file, &node->wait, wait);
+    if (r->pos < r->len || r->irec < r->nrecs || xstat_readable(node))
+        return POLLIN | POLLRDNORM;
+    return 0;
+}
+
+static const struct file_operations xstat_fops = {
+    .owner = THIS_MODULE,
+    .open = xstat_open,
+    .release = xstat_release,
+    .read = xstat_read,
+    .poll = xstat_poll,
+    .unlocked_ioctl = xstat_ioctl,
+    .compat_ioctl = xstat_ioctl,
+    .llseek = no_llseek,
+};
+
+static dev_t xstat_devt;
+static struct cdev xstat_cdev;
+
 static struct class_attribute xstat_class_attr[] = {
     __ATTR(ctrl, 0777, show_ctrl_attr, store_ctrl_attr),
     __ATTR(period, 0777, show_period_attr, store_period_attr),
+    __ATTR(schema, 0444, show_schema_attr, NULL),
+    __ATTR(watermark, 0644, show_watermark_attr, store_watermark_attr),
+    __ATTR(format, 0644, show_format_attr, store_format_attr),
+    __ATTR(noise, 0644, show_noise_attr, store_noise_attr),
+    __ATTR(idle, 0644, show_idle_attr, store_idle_attr),
+    __ATTR(snapshot, 0200, NULL, store_snapshot_attr),
+    XSTAT_GOV_CLASS_ATTRS
+    XSTAT_CAP_CLASS_ATTRS
+    __ATTR(model, 0644, show_model_attr, store_model_attr),
+#ifdef XSTAT_IPMI
+    XSTAT_IPMI_CLASS_ATTRS
+#endif
     __ATTR_NULL,
 };
 
+// Readable by all, so application ranks can time regions; see
+// xstat_privileged for the rest. Give a group write access to let its
+// members read records and put markers too.
+static char *xstat_devnode(struct device *dev, umode_t *mode) {
+    if (mode)
+        *mode = 0444;
+    return NULL;
+}
+
 static struct class xstat_class = {
     .name = "xstat",
     .owner = THIS_MODULE,
+    .devnode = xstat_devnode,
 
     .class_attrs = xstat_class_attr,
 };
@@ -363,7 +1666,10 @@ static int register_xstat_node(int nid) {
 
         node->id = nid;
         node->mask = cpumask_of_node(nid);
+        node->cpu = default_sampler_cpu(node->mask);
         spin_lock_init(&node->lock);
+        seqlock_init(&node->pmu_lock);
+        init_waitqueue_head(&node->wait);
 
         sprintf(node->stat_name, "stat%d", nid);
         node->stat_attr.attr.name = node->stat_name;
@@ -377,14 +1683,39 @@ static int register_xstat_node(int nid) {
         node->reset_attr.attr.name = node->reset_name;
         node->reset_attr.attr.mode = 0222;
         node->reset_attr.store = store_reset_attr;
+        sprintf(node->cpu_name, "cpu%d", nid);
+        node->cpu_attr.attr.name = node->cpu_name;
+        node->cpu_attr.attr.mode = 0644;
+        node->cpu_attr.show = show_cpu_attr;
+        node->cpu_attr.store = store_cpu_attr;
+        sprintf(node->jitter_name, "jitter%d", nid);
+        node->jitter_attr.attr.name = node->jitter_name;
+        node->jitter_attr.attr.mode = 0444;
+        node->jitter_attr.show = show_jitter_attr;
+        sprintf(node->events_name, "events%d", nid);
+        node->events_attr.attr.name = node->events_name;
+        node->events_attr.attr.mode = 0444;
+        node->events_attr.show = show_events_attr;
+        spin_lock_init(&node->events.lock);
 
         node->ctxs = kzalloc(sizeof(void *) * XSTAT_NCNT, GFP_KERNEL);
-        node->buffer = kzalloc(sizeof(uint64_t) * XSTAT_NCNT * XSTAT_NBUF, GFP_KERNEL);
-        node->working_buf = kzalloc(sizeof(uint64_t) * XSTAT_NCNT, GFP_KERNEL);
+        node->shared = kzalloc(sizeof(struct xstat_shared *) * XSTAT_NCNT, GFP_KERNEL);
+        node->last = kzalloc(sizeof(uint64_t) * XSTAT_NCNT, GFP_KERNEL);
+        node->nl = kcalloc(XSTAT_NL_NBATCH, sizeof(struct xstat_nl_batch), GFP_KERNEL);
+        node->pend = kcalloc(XSTAT_NPEND, sizeof(struct xstat_mark), GFP_KERNEL);
+        node->pend_size = node->pend ? XSTAT_NPEND : 0;
 
         err = class_create_file(&xstat_class, &node->stat_attr);
         err = class_create_file(&xstat_class, &node->last_attr);
         err = class_create_file(&xstat_class, &node->reset_attr);
+        err = class_create_file(&xstat_class, &node->cpu_attr);
+        err = class_create_file(&xstat_class, &node->jitter_attr);
+        err = class_create_file(&xstat_class, &node->events_attr);
+
+        node->dev = device_create(&xstat_class, NULL,
+                MKDEV(MAJOR(xstat_devt), nid), node, "xstat%d", nid);
+        if (IS_ERR(node->dev))
+            node->dev = NULL;
     }
 
     return err;
@@ -393,11 +1724,23 @@ static int register_xstat_node(int nid) {
 static void unregister_xstat_node(int nid) {
     struct xstat_node *node = xstat_nodes[nid];
     if (node) {
+        if (node->dev)
+            device_destroy(&xstat_class, MKDEV(MAJOR(xstat_devt), nid));
+        class_remove_file(&xstat_class, &node->events_attr);
+        class_remove_file(&xstat_class, &node->jitter_attr);
+        class_remove_file(&xstat_class, &node->cpu_attr);
         class_remove_file(&xstat_class, &node->reset_attr);
         class_remove_file(&xstat_class, &node->stat_attr);
         class_remove_file(&xstat_class, &node->last_attr);
-        kfree(node->working_buf);
+        kfree(node->pend);
+        kfree(node->nl);
+        kfree(node->last);
+        kfree(node->vals);
+        kfree(node->snap_rec);
+        kfree(node->rec);
         kfree(node->buffer);
+        put_layout(node->layout);
+        kfree(node->shared);
         kfree(node->ctxs);
         kfree(node);
         xstat_nodes[nid] = NULL;
@@ -407,9 +1750,17 @@ static void unregister_xstat_node(int nid) {
 static int __init xstat_init(void) {
     int ret, i;
 
-    spin_lock_init(&ctrl_lock);
+    mutex_init(&ctrl_lock);
+    init_srcu_struct(&region_srcu);
     ctrl_on = false;
     ctrl_period = 1000;
+    ctrl_watermark = 1;
+    ctrl_format = XSTAT_FMT_JSON;
+    xstat_gov_on = false;
+    xstat_gov_hyst = 3;
+    xstat_gov_loss = 5;
+    xstat_cap_budget = 0;
+    xstat_cap_step = 5;
 
     for (i = 0; i < MAX_NUMNODES; i++)
         xstat_nodes[i] = NULL;
@@ -418,25 +1769,61 @@ static int __init xstat_init(void) {
 	xstat_ipmi_init();
 #endif
     ret = class_register(&xstat_class); 
+    if (ret < 0)
+        goto err_ipmi;
+
+    ret = alloc_chrdev_region(&xstat_devt, 0, MAX_NUMNODES, "xstat");
+    if (ret < 0)
+        goto err_class;
+    cdev_init(&xstat_cdev, &xstat_fops);
+    xstat_cdev.owner = THIS_MODULE;
+    ret = cdev_add(&xstat_cdev, xstat_devt, MAX_NUMNODES);
+    if (ret < 0)
+        goto err_region;
 
     for_each_online_node(i) {
         register_xstat_node(i);
     }
+    xstat_pmu_init();
+    xstat_events_init();
+
+    if (xstat_nl_init() < 0)
+        printk(KERN_WARNING "xstat: generic netlink family not registered.\n");
+    return 0;
+
+err_region:
+    unregister_chrdev_region(xstat_devt, MAX_NUMNODES);
+err_class:
+    class_unregister(&xstat_class);
+err_ipmi:
+#ifdef XSTAT_IPMI
+	xstat_ipmi_exit();
+#endif
+    cleanup_srcu_struct(&region_srcu);
     return ret;
 }
 
 static void __exit xstat_exit(void) {
     int i;
 
+    // Samplers send on the family until they stop, and a netlink start that
+    // came in meanwhile is undone once the family is gone.
+    stop_stat();
+    xstat_nl_exit();
     stop_stat();
+    xstat_pmu_exit();
+    xstat_events_exit();
     for (i = 0; i < MAX_NUMNODES; i++) {
         if (xstat_nodes[i])
             unregister_xstat_node(i);
     }
+    cdev_del(&xstat_cdev);
+    unregister_chrdev_region(xstat_devt, MAX_NUMNODES);
     class_unregister(&xstat_class);
 #ifdef XSTAT_IPMI
 	xstat_ipmi_exit();
 #endif
+    cleanup_srcu_struct(&region_srcu);
 }
 
 module_init(xstat_init);
@@ -1,12 +1,66 @@
 #ifndef _XSTAT_H_
 #define _XSTAT_H_
 
+#include <linux/string.h>
 #include <linux/types.h>
 
 #define XSTAT_IPMI
+// Site tables pinning the IPMI layout; without them the sensors come from
+// the SDR repository, see ipmi_select.
 // #define XSTAT_COOLR
-#define XSTAT_CHAMELEON
+// #define XSTAT_CHAMELEON
+// Top-down breakdown; pins all general counters of a thread when HT is on.
+// #define XSTAT_TMA
 
+enum xstat_field_type {
+    XSTAT_U64,
+    XSTAT_S64,
+    XSTAT_U32,
+    XSTAT_S32,
+    XSTAT_U16,
+    XSTAT_S16,
+    XSTAT_U8,
+};
+
+// One typed value of a record; the value means raw * 10^scale unit. offset
+// is assigned when the session layout is built.
+#define XSTAT_FIELD_LEN 24
+#define XSTAT_UNIT_LEN  8
+struct xstat_field {
+    char name[XSTAT_FIELD_LEN];
+    char unit[XSTAT_UNIT_LEN];
+    uint8_t type;
+    int8_t scale;
+    uint8_t flags;
+    uint16_t offset;
+};
+
+// The value is what was counted since the last record, not a level.
+#define XSTAT_FIELD_DELTA 1
+
+static inline void xstat_field_init(struct xstat_field *field, const char *name,
+        const char *unit, uint8_t type, int8_t scale) {
+    strlcpy(field->name, name, XSTAT_FIELD_LEN);
+    strlcpy(field->unit, unit, XSTAT_UNIT_LEN);
+    field->type = type;
+    field->scale = scale;
+    field->flags = 0;
+}
+
+// What a counter's source covers. Node counters run in every node sampler;
+// the others are sampled once per tick for all nodes in the same system,
+// package, core or thread and their values shared.
+enum xstat_scope {
+    XSTAT_SCOPE_NODE,
+    XSTAT_SCOPE_SYSTEM,
+    XSTAT_SCOPE_PACKAGE,
+    XSTAT_SCOPE_CORE,
+    XSTAT_SCOPE_THREAD,
+};
+
+// A counter either returns one uint64_t from restart, or declares its
+// fields: fields(NULL, data) returns how many there are, fields(fields, data)
+// fills them, and sample writes one value per field.
 #define XSTAT_CNT_LEN   8
 struct xstat_counter {
     char name[XSTAT_CNT_LEN];
@@ -14,18 +68,49 @@ struct xstat_counter {
     void (*exit) (void **ctx);
     uint64_t (*restart) (void **ctx, uint64_t last);
     void (*reset) (void **ctx);
-    int (*scnprintf) (char *buf, int limit, uint64_t data, void **ctx);
+    int (*fields) (struct xstat_field *fields, void *data);
+    void (*sample) (void **ctx, uint64_t *vals);
     void *data;
+    uint8_t scope;
+    // Field flags of a restart counter.
+    uint8_t flags;
 };
 
-#define __XSTAT_CNT(aname, ainit, aexit, arestart, areset, ascnprintf) { \
+#define __XSTAT_FSCNT(aname, ainit, aexit, arestart, areset, ascope, aflags) { \
     .name = #aname, \
     .init = ainit, \
     .exit = aexit, \
     .restart = arestart, \
     .reset = areset, \
-    .scnprintf = ascnprintf, \
-    .data = NULL \
+    .fields = NULL, \
+    .sample = NULL, \
+    .data = NULL, \
+    .scope = ascope, \
+    .flags = aflags \
+}
+#define __XSTAT_SCNT(aname, ainit, aexit, arestart, areset, ascope) \
+    __XSTAT_FSCNT(aname, ainit, aexit, arestart, areset, ascope, 0)
+#define __XSTAT_CNT(aname, ainit, aexit, arestart, areset) \
+    __XSTAT_SCNT(aname, ainit, aexit, arestart, areset, XSTAT_SCOPE_NODE)
+// Restart counters returning a delta since the last record.
+#define __XSTAT_SDCNT(aname, ainit, aexit, arestart, areset, ascope) \
+    __XSTAT_FSCNT(aname, ainit, aexit, arestart, areset, ascope, XSTAT_FIELD_DELTA)
+#define __XSTAT_DCNT(aname, ainit, aexit, arestart, areset) \
+    __XSTAT_SDCNT(aname, ainit, aexit, arestart, areset, XSTAT_SCOPE_NODE)
+
+#define __XSTAT_SMCNT(aname, ainit, aexit, afields, asample, ascope) { \
+    .name = #aname, \
+    .init = ainit, \
+    .exit = aexit, \
+    .restart = NULL, \
+    .reset = NULL, \
+    .fields = afields, \
+    .sample = asample, \
+    .data = NULL, \
+    .scope = ascope, \
+    .flags = 0 \
 }
+#define __XSTAT_MCNT(aname, ainit, aexit, afields, asample) \
+    __XSTAT_SMCNT(aname, ainit, aexit, afields, asample, XSTAT_SCOPE_NODE)
 
 #endif
@@ -0,0 +1,120 @@
+#ifndef _XSTAT_IOCTL_H_
+#define _XSTAT_IOCTL_H_
+
+// ioctls on /dev/xstat<node>, shared with user space.
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+#define XSTAT_IOC_MAGIC 'x'
+
+// Copies records out of the ring without consuming them. By default these
+// are the records with ts in [t0, t1], at most count if count is set; with
+// XSTAT_RANGE_LAST the count newest records with ts <= t1. Records are laid
+// out as in the schema class attr.
+#define XSTAT_RANGE_LAST 1
+struct xstat_range {
+    __u64 t0;
+    __u64 t1;
+    __u32 count;
+    __u32 flags;
+    __u64 buf;      // user pointer
+    __u64 len;      // bytes at buf
+    // Filled in: record size, records copied and the sequence number of the
+    // first one within the session.
+    __u32 size;
+    __u32 nrecs;
+    __u64 seq;
+};
+
+#define XSTAT_IOC_RANGE _IOWR(XSTAT_IOC_MAGIC, 1, struct xstat_range)
+
+// kind field of a record.
+enum {
+    XSTAT_REC_SAMPLE,
+    XSTAT_REC_SNAPSHOT,
+    XSTAT_REC_MARKER,
+};
+
+// Has every node take a record now, with kind XSTAT_REC_SNAPSHOT and label
+// set. The records go to the rings and to buf, one per node: the __u32 node
+// id, 4 bytes of padding, then the record. Fails with ENODATA if sampling is
+// off, EPERM unless the device is open for writing or the caller has
+// CAP_SYS_ADMIN.
+struct xstat_snapshot {
+    __u64 label;
+    __u64 buf;      // user pointer
+    __u64 len;      // bytes at buf
+    // Filled in: record size and records copied.
+    __u32 size;
+    __u32 nrecs;
+};
+
+#define XSTAT_IOC_SNAPSHOT _IOWR(XSTAT_IOC_MAGIC, 2, struct xstat_snapshot)
+
+// Puts a record with kind XSTAT_REC_MARKER into the ring of the node, in ts
+// order with the samples. Only ts and the kind fields are set, tag going to
+// label; a short tag fits its 8 bytes. Fails with ENODATA if sampling is
+// off, EPERM as XSTAT_IOC_SNAPSHOT.
+struct xstat_marker {
+    __u32 phase;
+    __u32 rank;
+    __u64 tag;
+};
+
+#define XSTAT_IOC_MARKER _IOW(XSTAT_IOC_MAGIC, 3, struct xstat_marker)
+
+// Counts of a code region on the calling CPU, from the perf events xstat
+// already has open there, with the energy of its package. XSTAT_REGION_BEGIN
+// starts region id and XSTAT_REGION_END fills in the counts since. Regions
+// belong to the open file, so threads use their own; a thread that moved to
+// another CPU in between gets EXDEV. Fails with ENODATA if sampling is off.
+#define XSTAT_NREGION 32
+#define XSTAT_REGION_BEGIN 0
+#define XSTAT_REGION_END 1
+struct xstat_region {
+    __u32 id;
+    __u32 op;
+    // Filled in by XSTAT_REGION_END.
+    __u64 ns;
+    __u64 energy;   // uJ
+    __u64 cycles;
+    __u64 instructions;
+    __u64 llcmiss;
+};
+
+#define XSTAT_IOC_REGION _IOWR(XSTAT_IOC_MAGIC, 4, struct xstat_region)
+
+// Clock and thermal events of the node's CPUs, see events.c. Copies the events numbered seq and on to buf and sets seq to the
+// number of the next one, so a reader picks up where it left off. The node
+// keeps the last XSTAT_NEVENT; lost counts those gone before they were read.
+// Clocks are in kHz. A thermal event has the low 12 bits of
+// IA32_PACKAGE_THERM_STATUS in to, and the status bits of the tick before
+// in from.
+#define XSTAT_NEVENT 1024
+enum {
+    XSTAT_EVENT_FREQ,
+    XSTAT_EVENT_THERM,
+};
+
+struct xstat_event {
+    __u64 ts;
+    __u32 cpu;
+    __u32 type;
+    __u32 from;
+    __u32 to;
+};
+
+struct xstat_events {
+    __u64 seq;
+    __u64 buf;      // user pointer
+    __u64 len;      // bytes at buf
+    // Filled in: events copied and skipped.
+    __u32 nevents;
+    __u32 pad;
+    __u64 lost;
+};
+
+#define XSTAT_IOC_EVENTS _IOWR(XSTAT_IOC_MAGIC, 5, struct xstat_events)
+
+#endif
@@ -0,0 +1,40 @@
+#ifndef _XSTAT_NETLINK_H_
+#define _XSTAT_NETLINK_H_
+
+// Generic netlink interface of xstat, shared with user space.
+
+#define XSTAT_GENL_NAME     "xstat"
+#define XSTAT_GENL_VERSION  1
+#define XSTAT_GENL_MCGRP    "samples"
+
+enum {
+    XSTAT_CMD_UNSPEC,
+    XSTAT_CMD_START,
+    XSTAT_CMD_STOP,
+    XSTAT_CMD_GET_CONFIG,
+    XSTAT_CMD_SET_CONFIG,
+    XSTAT_CMD_SUBSCRIBE,
+    XSTAT_CMD_UNSUBSCRIBE,
+    XSTAT_CMD_SAMPLE,
+    __XSTAT_CMD_MAX,
+};
+#define XSTAT_CMD_MAX (__XSTAT_CMD_MAX - 1)
+
+enum {
+    XSTAT_ATTR_UNSPEC,
+    XSTAT_ATTR_ON,          // u8
+    XSTAT_ATTR_PERIOD,      // u32, ms
+    XSTAT_ATTR_WATERMARK,   // u32, records per batch
+    XSTAT_ATTR_SCHEMA,      // string, as the schema class attr
+    XSTAT_ATTR_COUNTERS,    // nested, counter index + 1 -> name
+    XSTAT_ATTR_NODE_MASK,   // u64, bit per node 0-63
+    XSTAT_ATTR_CNT_MASK,    // u64, bit per counter index, 0 for all
+    XSTAT_ATTR_NODE,        // u32
+    XSTAT_ATTR_SIZE,        // u32, record size
+    XSTAT_ATTR_RECORD,      // binary, a whole record
+    XSTAT_ATTR_FIELDS,      // nested, field index + 1 -> field bytes
+    __XSTAT_ATTR_MAX,
+};
+#define XSTAT_ATTR_MAX (__XSTAT_ATTR_MAX - 1)
+
+#endif
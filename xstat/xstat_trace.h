@@ -0,0 +1,66 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM xstat
+
+#if !defined(_XSTAT_TRACE_H_) || defined(TRACE_HEADER_MULTI_READ)
+#define _XSTAT_TRACE_H_
+
+#include <linux/tracepoint.h>
+
+// A committed record, laid out as in the schema class attr.
+TRACE_EVENT(xstat_sample,
+    TP_PROTO(int node, const char *rec, int size),
+    TP_ARGS(node, rec, size),
+    TP_STRUCT__entry(
+        __field(int, node)
+        __field(int, size)
+        __dynamic_array(char, rec, size)
+    ),
+    TP_fast_assign(
+        __entry->node = node;
+        __entry->size = size;
+        memcpy(__get_dynamic_array(rec), rec, size);
+    ),
+    TP_printk("node=%d size=%d rec=%s", __entry->node, __entry->size,
+        __print_hex(__get_dynamic_array(rec), __entry->size))
+);
+
+// Readers of /dev/xstat<node> woken at the watermark.
+TRACE_EVENT(xstat_wakeup,
+    TP_PROTO(int node, int queued),
+    TP_ARGS(node, queued),
+    TP_STRUCT__entry(
+        __field(int, node)
+        __field(int, queued)
+    ),
+    TP_fast_assign(
+        __entry->node = node;
+        __entry->queued = queued;
+    ),
+    TP_printk("node=%d queued=%d", __entry->node, __entry->queued)
+);
+
+// A tick that took longer than the period, so the next one starts late.
+TRACE_EVENT(xstat_deadline_miss,
+    TP_PROTO(int node, unsigned int period, uint64_t elapsed),
+    TP_ARGS(node, period, elapsed),
+    TP_STRUCT__entry(
+        __field(int, node)
+        __field(unsigned int, period)
+        __field(uint64_t, elapsed)
+    ),
+    TP_fast_assign(
+        __entry->node = node;
+        __entry->period = period;
+        __entry->elapsed = elapsed;
+    ),
+    TP_printk("node=%d period=%ums elapsed=%lluns", __entry->node,
+        __entry->period, __entry->elapsed)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE xstat_trace
+#include <trace/define_trace.h>